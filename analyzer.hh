@@ -28,12 +28,16 @@
 #include "threadstruct.hh"
 
 #include <vector>
+#include <map>
+#include <set>
 #include <algorithm>
+#include <sstream>
 
 using namespace std;
 
 #ifdef ENABLE_PREVENTION
 #include "prevention.hh"
+#include "history.hh"
 #endif
 
 #define PREV_INSTRUCTION_OFFSET 1
@@ -43,6 +47,9 @@ extern thread_t *threadsInfo;
 extern char *__progname_full;
 extern void* mainTop;
 extern void* textTop;
+#ifdef DEADLOCK_RECOVERY
+extern recovery_handler recoveryHandler;
+#endif
 
 class analyzer {
 public:
@@ -55,6 +62,23 @@ public:
 	}
 
 	void initialize() {
+		_pid = getpid();
+		memset(_analyzedSeq, 0, sizeof(_analyzedSeq));
+#ifdef WAIT_FOR_GRAPH
+		memset(_lastBlockedOn, 0, sizeof(_lastBlockedOn));
+		memset(_lastBlockEpoch, 0, sizeof(_lastBlockEpoch));
+#endif
+#ifdef DEADLOCK_RECOVERY
+		memset(_victimEpoch, 0, sizeof(_victimEpoch));
+		_deadlockRecovered = 0;
+#endif
+#ifdef PERIODIC_DETECTION
+		_periodicNext = 0;
+		_periodicStack = new ChainStack;
+		_detectSliceMs = xdefines::DETECT_SLICE_MS;
+		const char* slice = getenv("UNDEAD_DETECT_SLICE_MS");
+		if(slice != NULL && atoi(slice) > 0) _detectSliceMs = atoi(slice);
+#endif
 #ifdef ENABLE_PREVENTION
 		_mergeSetList = new MergeSetList();
 		_mergeSetList->next = NULL;
@@ -63,54 +87,65 @@ public:
 #endif
 	}
 
+	// output files are named after the process the records come from
+	void setPid(int pid) { _pid = pid; }
+
 	void finalize(int threadIndex) {
+#ifdef DEADLOCK_RECOVERY
+		if(_deadlockRecovered > 0) fprintf(stderr, "Deadlock recovery: %zu deadlocks broken during execution\n", _deadlockRecovered);
+#endif
 		if(threadIndex > 1) {	
 			_threadIndex = threadIndex;
 			analysis();
 		}
 #ifdef REPORTFILE
-		_reportFile.close();
+		closeOutput(_reportFile, _reportFilename);
 #endif
 	}
 
-	bool analysisCurrent(int threadIndex, ChainStack* stack, void** lastHolding) {
+	// on the snapshots taken by the monitor thread, live are the indexes of live threads
+	bool analysisCurrent(int* live, int liveCount, ChainStack* stack, holding_snapshot* snapshots) {
 		bool ret = false;
-		//if(threadIndex < 2) return ret;
-		bool isTraversed[threadIndex];
-		memset(isTraversed, 0, threadIndex * sizeof(bool));
-		for(int t = 0; t < threadIndex - 1; t++) {
-			thread_t* thread = &threadsInfo[t];
-			if(thread->curDep == NULL || thread->tIndex < 0) continue;
-			isTraversed[t] = true;
-			stack->push(thread->curDep, t);
-			ret |= dfsCurrent(stack, t, isTraversed, threadIndex, lastHolding);
+		bool isTraversed[liveCount]; // by position in live
+		memset(isTraversed, 0, liveCount * sizeof(bool));
+		for(int k = 0; k < liveCount - 1; k++) {
+			int t = live[k];
+			if(!isCurrent(t, snapshots)) continue;
+			isTraversed[k] = true;
+			stack->push(snapshots[t].curDep, t);
+			ret |= dfsCurrent(stack, k, isTraversed, live, liveCount, snapshots);
 			stack->pop();
-			thread->curDep = NULL;
+			// not again until its holdings change
+			_analyzedSeq[t] = snapshots[t].seq;
 		}
 		return ret;
 	}
 
+	INLINE bool isCurrent(int t, holding_snapshot* snapshots) {
+		return snapshots[t].curDep != NULL && snapshots[t].seq != _analyzedSeq[t];
+	}
+
 	// dfs on current dependency
-	bool dfsCurrent(ChainStack* stack, int visiting, bool* isTraversed, int threadIndex, void** lastHolding) {
+	bool dfsCurrent(ChainStack* stack, int visiting, bool* isTraversed, int* live, int liveCount, holding_snapshot* snapshots) {
 		bool ret = false;
-		for(int t = visiting + 1; t < threadIndex; t++) {
-			thread_t* thread = &threadsInfo[t];
-			if(thread->curDep == NULL || thread->tIndex < 0) continue;
-			if(!isTraversed[t]) {
-				Dependency* dep = thread->curDep;
+		for(int k = visiting + 1; k < liveCount; k++) {
+			int t = live[k];
+			if(!isCurrent(t, snapshots)) continue;
+			if(!isTraversed[k]) {
+				Dependency* dep = snapshots[t].curDep;
 				if(isChain(stack, dep)) {
 					if(isCycleChain(stack, dep)) {
 						ret |= true;
 						// found cycles in current status, further confirm
 						stack->push(dep, t); // complete the whole cycle in chain
+#ifdef ENABLE_PREVENTION
+						journalCycle(stack);
+#endif
 						bool sthNew = false;
 						for(ChainList* cl = stack->list->next; cl != NULL; cl = cl->next) {
-							thread_t* threadInChain = &threadsInfo[cl->tIndex];
-							int holds = threadInChain->holdingCount - 1;
-							// check holding status
-							if((holds >= 0 && lastHolding[cl->tIndex] != threadInChain->holdingSet[holds])
-									|| (holds < 0 && lastHolding[cl->tIndex] != NULL)) {
-								// something changed, not a real deadlock
+							size_t seq = __atomic_load_n(&threadsInfo[cl->tIndex].holdingSeq, __ATOMIC_ACQUIRE);
+							if(seq != snapshots[cl->tIndex].seq) {
+								// something changed since the snapshot, not a real deadlock
 								sthNew = true;
 								break;
 							}
@@ -122,11 +157,11 @@ public:
 						}
 						stack->pop(); // remove the cycled one
 					} else {
-						isTraversed[threadIndex] = true;
-						stack->push(dep, threadIndex);
-						ret |= dfsCurrent(stack, visiting, isTraversed, threadIndex, lastHolding);
+						isTraversed[k] = true;
+						stack->push(dep, t);
+						ret |= dfsCurrent(stack, visiting, isTraversed, live, liveCount, snapshots);
 						stack->pop();
-						isTraversed[threadIndex] = false;
+						isTraversed[k] = false;
 					}
 				}
 			}
@@ -134,30 +169,169 @@ public:
 		return ret;
 	}
 
+#ifdef WAIT_FOR_GRAPH
+	// confirm a deadlock on the wait-for graph. A thread is stalled if it is still in the blocking
+	// acquisition it was in at the last period, and it waits for the stalled thread holding that lock.
+	// Holdings of stalled threads can't change, so a cycle of them is a deadlock.
+	// They are read by snapshots, taken while the thread is still blocked.
+	// Return whether any thread blocks.
+	bool analysisBlocked(int* live, int liveCount, holding_snapshot* snapshots) {
+		// by position in live
+		bool stalled[liveCount];
+		bool blocked = false;
+		for(int k = 0; k < liveCount; k++) {
+			int t = live[k];
+			thread_t* thread = &threadsInfo[t];
+			// the holding set is complete once the lock is published
+			void* blockedOn = __atomic_load_n(&thread->blockedOn, __ATOMIC_ACQUIRE);
+			size_t epoch = __atomic_load_n(&thread->blockEpoch, __ATOMIC_RELAXED);
+			stalled[k] = blockedOn != NULL && blockedOn == _lastBlockedOn[t] && epoch == _lastBlockEpoch[t];
+			_lastBlockedOn[t] = blockedOn;
+			_lastBlockEpoch[t] = epoch;
+			if(blockedOn != NULL) blocked = true;
+			if(!stalled[k]) continue;
+			// unblocked meanwhile, the snapshot may not be the holdings it blocked with
+			if(!takeSnapshot(thread, &snapshots[t]) || __atomic_load_n(&thread->blockedOn, __ATOMIC_ACQUIRE) != blockedOn
+				|| __atomic_load_n(&thread->blockEpoch, __ATOMIC_RELAXED) != epoch) stalled[k] = false;
+		}
+		// held lock -> stalled owner, the last one in a holding set is the lock blocked on
+		vector<pair<void*, int> > heldBy;
+		for(int k = 0; k < liveCount; k++) {
+			if(!stalled[k]) continue;
+			holding_snapshot* snapshot = &snapshots[live[k]];
+			for(int i = 0; i < snapshot->holdingCount - 1; i++) heldBy.push_back(make_pair(snapshot->holdingSet[i], k));
+		}
+		if(heldBy.empty()) return blocked;
+		sort(heldBy.begin(), heldBy.end());
+		int waitFor[liveCount];
+		for(int k = 0; k < liveCount; k++) {
+			waitFor[k] = -1;
+			if(!stalled[k]) continue;
+			void* blockedOn = _lastBlockedOn[live[k]];
+			vector<pair<void*, int> >::iterator iter = lower_bound(heldBy.begin(), heldBy.end(), make_pair(blockedOn, -1));
+			if(iter != heldBy.end() && iter->first == blockedOn) waitFor[k] = iter->second;
+		}
+		// every thread waits for one at most, follow them from each thread
+		int walk[liveCount];
+		for(int k = 0; k < liveCount; k++) walk[k] = -1;
+		for(int k = 0; k < liveCount; k++) {
+			int u = k;
+			while(u >= 0 && walk[u] < 0) {
+				walk[u] = k;
+				u = waitFor[u];
+			}
+			if(u >= 0 && walk[u] == k) reportBlocked(u, waitFor, live, snapshots);
+		}
+		return blocked;
+	}
+
+	// u is in a cycle, each thread holds the lock the previous one blocks on
+	void reportBlocked(int u, int* waitFor, int* live, holding_snapshot* snapshots) {
+		ChainStack stack;
+		bool recorded = true; // every blocking acquisition has its dependency
+		int k = u;
+		do {
+			Dependency* curDep = snapshots[live[k]].curDep;
+			// none for an acquisition while single threaded, the lock blocked on is still known
+			if(curDep == NULL) recorded = false;
+			stack.push(curDep, live[k]);
+			k = waitFor[k];
+		} while(k != u);
+#ifdef DEADLOCK_RECOVERY
+		if(recoverBlocked(&stack, recorded, snapshots)) return;
+#endif
+#ifdef ENABLE_PREVENTION
+		if(recorded) journalCycle(&stack);
+		else fprintf(stderr, "Some acquisitions of the cycle have no dependency, it is not kept in history\n");
+#endif
+		reportDeadlockCurrent(&stack);
+		fprintf(stderr, "\nMonitor thread found cycles in current status! Now exit!\n");
+		exit(0);
+	}
+#endif
+
+#ifdef DEADLOCK_RECOVERY
+	// break a cycle of stalled threads instead of exiting, false if none of them can give up.
+	// The victim holds the fewest locks. Its pending acquisition fails with EDEADLK,
+	// unless the handler registered by the application takes care of it.
+	bool recoverBlocked(ChainStack* stack, bool recorded, holding_snapshot* snapshots) {
+		int victim = -1;
+		for(ChainList* cl = stack->list->next; cl != NULL; cl = cl->next) {
+			int t = cl->tIndex;
+			// picked already, waiting for it to give up
+			if(_victimEpoch[t] == _lastBlockEpoch[t]) return true;
+			if(!isRecoverable(_lastBlockedOn[t])) continue;
+			if(victim < 0 || snapshots[t].holdingCount < snapshots[victim].holdingCount) victim = t;
+		}
+		if(victim < 0) return false;
+		reportDeadlockCurrent(stack);
+		fprintf(stderr, "\nMonitor thread breaks the deadlock at thread %d\n", victim);
+#ifdef ENABLE_PREVENTION
+		if(recorded) storeCycle(stack);
+#endif
+		_victimEpoch[victim] = _lastBlockEpoch[victim];
+		_deadlockRecovered++;
+		thread_t* thread = &threadsInfo[victim];
+		recovery_handler handler = __atomic_load_n(&recoveryHandler, __ATOMIC_ACQUIRE);
+		if(handler != NULL && handler(thread->self, _lastBlockedOn[victim]) != 0) return true;
+		__atomic_store_n(&thread->victimEpoch, _lastBlockEpoch[victim], __ATOMIC_RELEASE);
+		return true;
+	}
+
+	// a member keeping its own mutex may hold a gate or pins for the acquisition, it can't give up
+	bool isRecoverable(void* lock) {
+#if defined(ENABLE_PREVENTION) && defined(KEEP_MEMBER_MUTEX)
+		if((INDIRECTION_MASK & (uintptr_t)lock) == INDIRECTION_MASK) return true;
+		my_mutex* real = (my_mutex*)getSyncEntry(lock);
+		if((void*)real != lock && real->specialSlot >= 0) return false;
+#endif
+		return true;
+	}
+
+#ifdef ENABLE_PREVENTION
+	// the process goes on, so the cycle is merged into the history file right away
+	void storeCycle(ChainStack* stack) {
+		vector<Dependency*> deps;
+		for(ChainList* cl = stack->list->next; cl != NULL; cl = cl->next) deps.push_back(cl->depEntry);
+		journal_record record;
+		if(!getCycleRecord(deps, &record)) return;
+		ostringstream found;
+		history::writeCycle(found, &record);
+		string deadlockFilename = string(__progname_full) + DEADLOCK_FILE;
+		history::store(deadlockFilename.c_str(), found.str());
+	}
+#endif
+#endif
+
 	void analysis() {
 		// create output files
 		fprintf(stderr, "Create output files with %s\n", __progname_full);
 		char pidBuf[10];
-		sprintf(pidBuf, "%d", getpid());
+		sprintf(pidBuf, "%d", _pid);
 		string pid = string(pidBuf);
 #ifdef REPORTFILE
-		string reportFilename = string(__progname_full) + "_" + pid + ".report";
-		_reportFile.open(reportFilename.c_str(), ios::trunc);
+		_reportFilename = string(__progname_full) + "_" + pid + ".report";
+		openOutput(_reportFile, _reportFilename);
 #endif
 #ifdef ENABLE_LOG
-		string logFilename = string(__progname_full) + "_" + pid + ".synclog";
-		_logFile.open(logFilename.c_str(), ios::trunc);
+		_logFilename = string(__progname_full) + "_" + pid + ".synclog";
+		openOutput(_logFile, _logFilename);
 #endif
 		// if unique denpendencies < 2
 		if(precheck() < 2) return;
 #ifdef ENABLE_PREVENTION
 		string deadlockFilename =  string(__progname_full) + DEADLOCK_FILE;
-		_deadlockFile.open(deadlockFilename.c_str(), ios::trunc);
+		_realMutexMap.initialize(HashFuncs::hashAddr, HashFuncs::compareAddr, xdefines::MAX_SYNC_ITEMS);
+		for(DependencyHashMap::iterator iter = _dependencyMap.begin(); iter != _dependencyMap.end(); iter++) {
+			Dependency* dep = iter.getData();
+			_realMutexMap.insertIfAbsent(dep->lock, sizeof(void*), dep->realLock);
+		}
 		// perform detection
 		detect();
 		// update prevention
 		generateMergeSetInfo();
-		_deadlockFile.close();
+		// other processes of the same program may share the history file
+		history::store(deadlockFilename.c_str(), _deadlockFile.str());
 #endif
 	}
 
@@ -200,6 +374,13 @@ public:
 					depGlobal->condRelated = dep->condRelated;
 #endif
 				}
+				// keep acquisition call sites from all threads
+				for(int k = 0; k < dep->callsiteCount; k++) {
+					depGlobal->addNewCallsite(dep->callerAddr[k][0], dep->callerAddr[k][1]);
+				}
+				for(int k = 0; k < dep->holdingCallsiteCount; k++) {
+					depGlobal->addHoldingCallsite(dep->holdingCallerIndex[k], dep->holdingCallerAddr[k]);
+				}
 #ifdef ENABLE_LOG
 				_logFile<<"    "<<dep->lock<<" : ";
 				for(int i = 0; i < dep->holdingCount; i++) {
@@ -210,7 +391,7 @@ public:
 			}
 		}
 #ifdef ENABLE_LOG
-		_logFile.close();
+		closeOutput(_logFile, _logFilename);
 #endif
 		//fprintf(stderr, "record amount of dep %zu unique dep %zu\n", depAmount, depCount);
 		return depCount;
@@ -232,6 +413,9 @@ public:
 		// initilize statistic data;
 		_deadlockReported = _deadlockFound = 0;
 		_deadlockMap.initialize(HashFuncs::hashString, HashFuncs::compareString, xdefines::MAX_DEADLOCK);
+#ifdef ENABLE_PREVENTION
+		_lockIdMap.initialize(HashFuncs::hashAddr, HashFuncs::compareAddr, xdefines::MAX_SYNC_ITEMS);
+#endif
 		int visiting;
 		ChainStack* stack = new ChainStack;
 		bool* isTraversed = new bool[_threadIndex];
@@ -301,18 +485,278 @@ public:
 		}
 	}
 
+#ifdef ENABLE_PREVENTION
+	// append a cycle found in current status to the journal, so that it survives a crash
+	void journalCycle(ChainStack* stack) {
+		vector<Dependency*> deps;
+		for(ChainList* cl = stack->list->next; cl != NULL; cl = cl->next) deps.push_back(cl->depEntry);
+		vector<void*> locks;
+		for(size_t i = 0; i < deps.size(); i++) locks.push_back(deps[i]->lock);
+		sort(locks.begin(), locks.end());
+		if(!_journaledCycles.insert(locks).second) return;
+		journal_record record;
+		if(!getCycleRecord(deps, &record)) return;
+		string journalFilename = string(__progname_full) + DEADLOCK_JOURNAL;
+		history::appendJournal(journalFilename.c_str(), &record);
+	}
+
+	// the locks of a cycle with their init call stacks and acquisition call sites.
+	// Cycles through a shared lock are left to the analysis at exit,
+	// and the ones related to cond are not merged, as in reportDeadlock().
+	bool getCycleRecord(vector<Dependency*>& deps, journal_record* record) {
+		if(deps.size() < 2 || deps.size() > xdefines::JOURNAL_CYCLE_MAX) return false;
+		for(size_t i = 0; i < deps.size(); i++) {
+			if((INDIRECTION_MASK & (uintptr_t)deps[i]->lock) == INDIRECTION_MASK) return false;
+			if(deps[i]->condRelated) return false;
+		}
+		memset(record, 0, sizeof(journal_record));
+		record->count = deps.size();
+		for(size_t i = 0; i < deps.size(); i++) {
+			Dependency* dep = deps[i];
+			journal_lock* jl = &record->locks[i];
+			jl->lock = dep->lock;
+			my_mutex* real = (my_mutex*)dep->realLock;
+			if(real != NULL && real->callsite != NULL) {
+				jl->found = real->callsite->found;
+				memcpy(jl->stack, real->callsite->stack, sizeof(jl->stack));
+			}
+			for(int c = 0; c < dep->callsiteCount && jl->sites < xdefines::JOURNAL_SITE_MAX; c++) {
+				jl->site[jl->sites][0] = dep->callerAddr[c][0];
+				jl->site[jl->sites++][1] = dep->callerAddr[c][1];
+			}
+			// where the next one in the cycle holds it
+			Dependency* next = deps[(i + 1) % deps.size()];
+			for(int c = 0; c < next->holdingCallsiteCount && jl->sites < xdefines::JOURNAL_SITE_MAX; c++) {
+				if(next->holdingSet[next->holdingCallerIndex[c]] != dep->lock) continue;
+				jl->site[jl->sites][0] = next->holdingCallerAddr[c];
+				jl->site[jl->sites++][1] = NULL;
+			}
+		}
+		return true;
+	}
+#endif
+
+#ifdef PERIODIC_DETECTION
+	// search cycles through the dependencies recorded since the last pass, while the program runs.
+	// Records of joined threads come first, then the ones of the threadIndex threads created so far.
+	// Every new dependency starts a search, taken round-robin by record. A pass stops once its
+	// time slice is used up, even inside a search, and the next one resumes from there.
+	// Found cycles are reported and merged into the history file.
+	void detectPeriodic(int threadIndex, int joined) {
+		uint64_t deadline = getNanos() + _detectSliceMs * 1000000UL;
+		for(int j = 0; j < joined; j++) addPeriodicRecord(threadsInfoReal[j].dependencies, threadsInfoReal[j].depCount);
+		for(int t = 0; t < threadIndex; t++) {
+			thread_t* thread = &threadsInfo[t];
+			Dependency* deps;
+			size_t count;
+			// a record reused meanwhile is published with its count cleared
+			do {
+				deps = __atomic_load_n(&thread->dependencies, __ATOMIC_ACQUIRE);
+				count = __atomic_load_n(&thread->depCount, __ATOMIC_ACQUIRE);
+			} while(deps != __atomic_load_n(&thread->dependencies, __ATOMIC_ACQUIRE));
+			addPeriodicRecord(deps, count);
+		}
+		ostringstream found;
+		for(size_t steps = 0; ; steps++) {
+			if(steps % xdefines::DETECT_CLOCK_STEPS == 0 && getNanos() > deadline) break;
+			if(_periodicFrames.empty() && !startPeriodic()) break;
+			stepPeriodic(found);
+		}
+#ifdef ENABLE_PREVENTION
+		if(found.tellp() > 0) {
+			string deadlockFilename = string(__progname_full) + DEADLOCK_FILE;
+			history::store(deadlockFilename.c_str(), found.str());
+		}
+#endif
+	}
+
+	// a record is known by its dependencies, those of a joined thread are already known from when it ran
+	void addPeriodicRecord(Dependency* deps, size_t count) {
+		map<Dependency*, int>::iterator iter = _periodicIndex.find(deps);
+		if(iter == _periodicIndex.end()) {
+			_periodicIndex[deps] = _periodicRecords.size();
+			periodic_record record = {deps, count, 0, false};
+			_periodicRecords.push_back(record);
+		} else if(count > _periodicRecords[iter->second].count) {
+			_periodicRecords[iter->second].count = count;
+		}
+	}
+
+	// take the next dependency not searched yet as the root of a search
+	bool startPeriodic() {
+		int amount = _periodicRecords.size();
+		for(int k = 0; k < amount; k++) {
+			int r = (_periodicNext + k) % amount;
+			periodic_record* record = &_periodicRecords[r];
+			if(record->mark == record->count) continue;
+			pushPeriodic(r, &record->deps[record->mark++]);
+			// the next search starts with the next record
+			_periodicNext = (r + 1) % amount;
+			return true;
+		}
+		return false;
+	}
+
+	// try the next candidate of the search on top, any record can close the cycle
+	void stepPeriodic(ostringstream& found) {
+		periodic_frame* frame = &_periodicFrames.back();
+		while(frame->record < (int)_periodicRecords.size()) {
+			periodic_record* record = &_periodicRecords[frame->record];
+			if(record->traversed || frame->dep >= record->count) {
+				frame->record++;
+				frame->dep = 0;
+				continue;
+			}
+			Dependency* dep = &record->deps[frame->dep++];
+			if(!isChain(_periodicStack, dep)) return;
+			if(isCycleChain(_periodicStack, dep)) reportPeriodic(_periodicStack, dep, found);
+			else pushPeriodic(frame->record, dep);
+			return;
+		}
+		// all candidates tried
+		_periodicRecords[frame->owner].traversed = false;
+		_periodicStack->pop();
+		_periodicFrames.pop_back();
+	}
+
+	void pushPeriodic(int owner, Dependency* dep) {
+		_periodicRecords[owner].traversed = true;
+		_periodicStack->push(dep);
+		periodic_frame frame = {owner, 0, 0};
+		_periodicFrames.push_back(frame);
+	}
+
+	void reportPeriodic(ChainStack* stack, Dependency* dep, ostringstream& found) {
+		vector<Dependency*> deps;
+		for(ChainList* cl = stack->list->next; cl != NULL; cl = cl->next) deps.push_back(cl->depEntry);
+		deps.push_back(dep);
+		vector<void*> locks;
+		for(size_t i = 0; i < deps.size(); i++) locks.push_back(deps[i]->lock);
+		sort(locks.begin(), locks.end());
+		if(!_periodicCycles.insert(locks).second) return;
+		fprintf(stderr, "Deadlock found during execution: \n");
+		for(size_t i = 0; i < deps.size(); i++) {
+			fprintf(stderr, "%p -> ", deps[i]->lock);
+#ifdef DETAILREPORT
+			getLockCallSite(deps[i]);
+#endif
+		}
+		fprintf(stderr, "\n");
+#ifdef ENABLE_PREVENTION
+		journal_record record;
+		if(getCycleRecord(deps, &record)) history::writeCycle(found, &record);
+#endif
+	}
+#endif
+
+#ifdef ON_DEMAND_REPORT
+	// asked by SIGUSR2, search cycles through records copied by the monitor thread while
+	// the program runs, report them and merge them into the history file
+	void reportOnDemand(real_thread_t* records, int amount) {
+		fprintf(stderr, "Generating report on demand:\n");
+#ifdef REPORTFILE
+		char pidBuf[16];
+		sprintf(pidBuf, "_%d", _pid);
+		_reportFilename = string(__progname_full) + pidBuf + "_ondemand.report";
+		openOutput(_reportFile, _reportFilename);
+#endif
+		ChainStack* stack = new ChainStack;
+		bool* isTraversed = new bool[amount]();
+		set<vector<void*> > cycles;
+		ostringstream found;
+		for(int t = 0; t < amount - 1; t++) {
+			isTraversed[t] = true;
+			for(size_t j = 0; j < records[t].depCount; j++) {
+				stack->push(&records[t].dependencies[j]);
+				dfsOnDemand(stack, t, isTraversed, records, amount, cycles, found);
+				stack->pop();
+			}
+			isTraversed[t] = false;
+		}
+		delete stack;
+		delete[] isTraversed;
+		fprintf(stderr, "%zu potential deadlocks in %d thread records\n", cycles.size(), amount);
+#ifdef REPORTFILE
+		closeOutput(_reportFile, _reportFilename);
+#endif
+#ifdef ENABLE_PREVENTION
+		if(found.tellp() > 0) {
+			string deadlockFilename = string(__progname_full) + DEADLOCK_FILE;
+			history::store(deadlockFilename.c_str(), found.str());
+		}
+#endif
+	}
+
+	void dfsOnDemand(ChainStack* stack, int visiting, bool* isTraversed, real_thread_t* records, int amount, set<vector<void*> >& cycles, ostringstream& found) {
+		for(int t = visiting + 1; t < amount; t++) {
+			if(isTraversed[t]) continue;
+			for(size_t j = 0; j < records[t].depCount; j++) {
+				Dependency* dep = &records[t].dependencies[j];
+				if(!isChain(stack, dep)) continue;
+				if(isCycleChain(stack, dep)) {
+					reportOnDemandCycle(stack, dep, cycles, found);
+				} else {
+					isTraversed[t] = true;
+					stack->push(dep);
+					dfsOnDemand(stack, visiting, isTraversed, records, amount, cycles, found);
+					stack->pop();
+					isTraversed[t] = false;
+				}
+			}
+		}
+	}
+
+	void reportOnDemandCycle(ChainStack* stack, Dependency* dep, set<vector<void*> >& cycles, ostringstream& found) {
+		vector<Dependency*> deps;
+		for(ChainList* cl = stack->list->next; cl != NULL; cl = cl->next) deps.push_back(cl->depEntry);
+		deps.push_back(dep);
+		vector<void*> locks;
+		for(size_t i = 0; i < deps.size(); i++) locks.push_back(deps[i]->lock);
+		sort(locks.begin(), locks.end());
+		if(!cycles.insert(locks).second) return;
+		fprintf(stderr, "Deadlock: \n");
+#ifdef REPORTFILE
+		_reportFile<<"Deadlock: "<<endl;
+#endif
+		for(size_t i = 0; i < deps.size(); i++) {
+			fprintf(stderr, "%p -> ", deps[i]->lock);
+#ifdef REPORTFILE
+			_reportFile<<deps[i]->lock<<" -> ";
+#endif
+#ifdef DETAILREPORT
+			getLockCallSite(deps[i]);
+#endif
+		}
+		fprintf(stderr, "\n");
+#ifdef REPORTFILE
+		_reportFile<<endl;
+#endif
+#ifdef ENABLE_PREVENTION
+		journal_record record;
+		if(getCycleRecord(deps, &record)) history::writeCycle(found, &record);
+#endif
+	}
+#endif
+
 	// output deadlocks detected from current status
 	// current chain will be the whole cycle
 	void reportDeadlockCurrent(ChainStack *stack) {
 		fprintf(stderr, "Deadlock: \n");
 		for(ChainList* cl = stack->list->next; cl != NULL; cl = cl->next) {
-			fprintf(stderr, "%p -> ", cl->depEntry->lock);
+			void* lock = cl->depEntry != NULL ? cl->depEntry->lock : NULL;
+#ifdef WAIT_FOR_GRAPH
+			if(lock == NULL) lock = _lastBlockedOn[cl->tIndex];
+#endif
+			fprintf(stderr, "%p -> ", lock);
 		}
 	}
 
 	// output all deadlocks detected in the end
 	// chain + dep will be the whole cycle
 	void reportDeadlock(ChainStack *stack, Dependency* dep) {
+#if defined(ENABLE_PREVENTION) && defined(ENABLE_AVOIDANCE)
+		if(isAvoidedDeadlock(stack, dep)) return;
+#endif
 		_deadlockReported++;
 		vector<uintptr_t> locks; // record locks involved in this deadlock 
 		size_t size = 0; // how many locks in this deadlock
@@ -370,64 +814,178 @@ public:
 #ifdef ENABLE_PREVENTION
 			// if related to cond, don't apply merging on it
 			if(!needMerge) return;
-			char tmp;
-			MergeSetList *temp = new MergeSetList();
-			for(size_t i = 0; i < size; i++) temp->mergeSet.insert((void*)locks[i]);
-			_mergeSetTail->next = temp;
-			_mergeSetTail = _mergeSetTail->next;
+			int first = getLockId((void*)locks[0]);
+			_ufMerged[findSet(first)] = true;
+			for(size_t i = 1; i < size; i++) unionSet(first, getLockId((void*)locks[i]), NULL);
 #endif
 		}
 	}
 
 #ifdef ENABLE_PREVENTION
-	// union merge sets if there're intersections
-	void mergeSetUnion() {
-		int count = 0;
-		for(MergeSetList* i = _mergeSetList->next; i != NULL; i = i->next) {
-			fprintf(stderr, "merge set #%d:", count++);
-			for(MergeSet::iterator iter = i->mergeSet.begin(); iter != i->mergeSet.end(); iter++) {
-				fprintf(stderr, " %p", *iter);
+#ifdef ENABLE_AVOIDANCE
+	// a known deadlock whose locks all belong to one avoided set in history
+	bool isAvoidedDeadlock(ChainStack *stack, Dependency* dep) {
+		int member;
+		int set = getHistoryMember(dep->lock, &member);
+		if(set < 0 || member < 0) return false;
+		if(!prevention::getInstance().isAvoidedSet(set)) return false;
+		for(ChainList* cl = stack->list->next; cl != NULL; cl = cl->next) {
+			if(getHistoryMember(cl->depEntry->lock, &member) != set) return false;
+		}
+		return true;
+	}
+#endif
+
+	// merge sets are kept as a union-find over lock ids
+	int getLockId(void* lock) {
+		int id;
+		if(_lockIdMap.find(lock, sizeof(void*), &id)) return id;
+		id = _ufLock.size();
+		_lockIdMap.insert(lock, sizeof(void*), id);
+		_ufLock.push_back(lock);
+		_ufParent.push_back(id);
+		_ufMerged.push_back(false);
+		_ufMembers.push_back(vector<int>(1, id));
+		_lockDeps.push_back(vector<int>());
+		return id;
+	}
+
+	int findSet(int id) {
+		while(_ufParent[id] != id) {
+			_ufParent[id] = _ufParent[_ufParent[id]];
+			id = _ufParent[id];
+		}
+		return id;
+	}
+
+	// union by size. Dependencies referring to the locks of the smaller set
+	// change their view of the sets, so they are queued for another check.
+	void unionSet(int a, int b, vector<int>* worklist) {
+		int ra = findSet(a), rb = findSet(b);
+		if(ra == rb) return;
+		if(_ufMembers[ra].size() < _ufMembers[rb].size()) swap(ra, rb);
+		for(size_t i = 0; worklist != NULL && i < _ufMembers[rb].size(); i++) {
+			int member = _ufMembers[rb][i];
+			for(size_t j = 0; j < _lockDeps[member].size(); j++) {
+				int d = _lockDeps[member][j];
+				if(!_depQueued[d]) {
+					_depQueued[d] = true;
+					worklist->push_back(d);
+				}
 			}
-			fprintf(stderr, "\n");
 		}
-		MergeSet temp;
-		bool flag = true;
-		// keep union merge sets till there's no intersection
-		while(flag) {
-			flag = false;
-			for(MergeSetList* i = _mergeSetList->next; i != NULL; i = i->next) {
-				MergeSetList* jHead = i;
-				for(MergeSetList* j = i->next; j != NULL; j = j->next) {
-					temp.clear();
-					set_intersection(i->mergeSet.begin(),i->mergeSet.end(),j->mergeSet.begin(),j->mergeSet.end(),insert_iterator<MergeSet>(temp,temp.begin()));
-					if(!temp.empty()) {
-						flag = true;
-						set_union(i->mergeSet.begin(),i->mergeSet.end(),j->mergeSet.begin(),j->mergeSet.end(),insert_iterator<MergeSet>(i->mergeSet,i->mergeSet.begin()));
-						jHead->next = j->next;
-						continue;
+		_ufMembers[ra].insert(_ufMembers[ra].end(), _ufMembers[rb].begin(), _ufMembers[rb].end());
+		vector<int>().swap(_ufMembers[rb]);
+		_ufParent[rb] = ra;
+		_ufMerged[ra] = _ufMerged[ra] || _ufMerged[rb];
+	}
+
+	// return the representative of the merge set that includes the addr, or -1
+	int getRelatedMergeSet(void* addr) {
+		int id;
+		if(!_lockIdMap.find(addr, sizeof(void*), &id)) return -1;
+		id = findSet(id);
+		return _ufMerged[id] ? id : -1;
+	}
+
+	// a dependency holding a merged lock while acquiring another lock of the same set
+	// pulls all locks acquired in between into that set. Run it to a fixpoint.
+	void mergeSetClosure() {
+		vector<Dependency*> deps;
+		for(DependencyHashMap::iterator iter = _dependencyMap.begin(); iter != _dependencyMap.end(); iter++) {
+			Dependency* dep = iter.getData();
+			if(dep->condRelated) continue;
+			int d = deps.size();
+			deps.push_back(dep);
+			_lockDeps[getLockId(dep->lock)].push_back(d);
+			for(int i = 0; i < dep->holdingCount; i++) {
+				vector<int>& refs = _lockDeps[getLockId(dep->holdingSet[i])];
+				if(refs.empty() || refs.back() != d) refs.push_back(d);
+			}
+		}
+		vector<int> worklist;
+		do {
+			_depQueued.assign(deps.size(), true);
+			for(int d = deps.size() - 1; d >= 0; d--) worklist.push_back(d);
+			while(!worklist.empty()) {
+				int d = worklist.back();
+				worklist.pop_back();
+				_depQueued[d] = false;
+				Dependency* dep = deps[d];
+				int set = getRelatedMergeSet(dep->lock);
+				if(set < 0) continue;
+				for(int i = 0; i < dep->holdingCount - 1; i++) {
+					if(findSet(getLockId(dep->holdingSet[i])) == set) {
+						// holding other locks between two deadlock-related locks
+						for(int j = i + 1; j < dep->holdingCount; j++) {
+							unionSet(set, getLockId(dep->holdingSet[j]), &worklist);
+						}
+						break;
 					}
-					jHead = j;
 				}
 			}
-		}
-		count = 0;
-		for(MergeSetList* i = _mergeSetList->next; i != NULL; i = i->next) {
-			fprintf(stderr, "after union, merge set #%d:", count++);
-			for(MergeSet::iterator iter = i->mergeSet.begin(); iter != i->mergeSet.end(); iter++) {
-				fprintf(stderr, " %p", *iter);
+		} while(joinHistorySets());
+	}
+
+	// the merge set in history that the lock belongs to, or -1.
+	// member is its index in that set, or -1 when the lock stands for the whole set.
+	int getHistoryMember(void* lock, int* member) {
+		*member = -1;
+		if((INDIRECTION_MASK & (uintptr_t)lock) == INDIRECTION_MASK) return getSpecialLockIndex(lock);
+#ifdef KEEP_MEMBER_MUTEX
+		// members of an ordered or gated set keep their own mutexes
+		void* realLock = NULL;
+		_realMutexMap.find(lock, sizeof(void*), &realLock);
+		if(realLock == NULL || realLock == lock) return -1;
+		int slot = ((my_mutex*)realLock)->specialSlot;
+		if(slot < 0 || slot >= prevention::getInstance().getSpecialSlotAmount()) return -1;
+		*member = prevention::getInstance().getSlotMember(slot);
+		return prevention::getInstance().getSlotSet(slot);
+#else
+		return -1;
+#endif
+	}
+
+	// members of one set in history are never split into different merge sets
+	bool joinHistorySets() {
+		vector<int> first(prevention::getInstance().getMergeSetAmount(), -1);
+		bool joined = false;
+		for(size_t id = 0; id < _ufLock.size(); id++) {
+			if(!_ufMerged[findSet(id)]) continue;
+			int member;
+			int set = getHistoryMember(_ufLock[id], &member);
+			if(set < 0) continue;
+			if(first[set] < 0) {
+				first[set] = id;
+			} else if(findSet(first[set]) != findSet(id)) {
+				unionSet(first[set], id, NULL);
+				joined = true;
 			}
-			fprintf(stderr, "\n");
 		}
+		return joined;
 	}
 
-	// return the merge set that includes the addr
-	MergeSetList* getRelatedMergeSet(void* addr) {
+	// collect the final merge sets from the union-find
+	void buildMergeSetList() {
+		vector<MergeSetList*> sets(_ufLock.size(), (MergeSetList*)NULL);
+		int count = 0;
+		for(size_t id = 0; id < _ufLock.size(); id++) {
+			int root = findSet(id);
+			if(!_ufMerged[root]) continue;
+			if(sets[root] == NULL) {
+				sets[root] = new MergeSetList();
+				_mergeSetTail->next = sets[root];
+				_mergeSetTail = sets[root];
+			}
+			sets[root]->mergeSet.insert(_ufLock[id]);
+		}
 		for(MergeSetList* i = _mergeSetList->next; i != NULL; i = i->next) {
-			if(i->mergeSet.find(addr) != i->mergeSet.end()) {
-				return i;
+			fprintf(stderr, "merge set #%d:", count++);
+			for(MergeSet::iterator iter = i->mergeSet.begin(); iter != i->mergeSet.end(); iter++) {
+				fprintf(stderr, " %p", *iter);
 			}
+			fprintf(stderr, "\n");
 		}
-		return NULL;
 	}
 
 	// write call stacks into deadlock history file
@@ -454,89 +1012,163 @@ public:
 		_deadlockFile<<"."<<endl;
 	}
 
+	// write acquisition call sites of a lock into deadlock history file
+	// nested acquisitions have two levels, the outer ones only have the 1st level
+	void writeAcqCallsite(void* lock) {
+		Dependency* merged = new Dependency();
+		merged->callsiteCount = 0;
+		for(DependencyHashMap::iterator iter = _dependencyMap.begin(); iter != _dependencyMap.end(); iter++) {
+			Dependency* dep = iter.getData();
+			if(dep->lock == lock) {
+				for(int i = 0; i < dep->callsiteCount; i++) {
+					merged->addNewCallsite(dep->callerAddr[i][0], dep->callerAddr[i][1]);
+				}
+			}
+			for(int i = 0; i < dep->holdingCallsiteCount; i++) {
+				if(dep->holdingSet[dep->holdingCallerIndex[i]] == lock) {
+					merged->addNewCallsite(dep->holdingCallerAddr[i], NULL);
+				}
+			}
+		}
+		for(int i = 0; i < merged->callsiteCount; i++) {
+			_deadlockFile<<"@ "<<(uintptr_t)merged->callerAddr[i][0]<<" "<<(uintptr_t)merged->callerAddr[i][1]<<endl;
+		}
+		delete merged;
+	}
+
+	// write a lock recorded in previous history into deadlock history file
+	void writeSpecialInfo(special_info* info) {
+		_deadlockFile<<" "<<(uintptr_t)info->lock;
+		for(int i = 0; i < info->callsite->found; i++) {
+			_deadlockFile<<" "<<(uintptr_t)info->callsite->stack[i];
+		}
+		_deadlockFile<<"."<<endl;
+		for(acq_callsite* site = info->acqsite; site != NULL; site = site->next) {
+			_deadlockFile<<"@ "<<(uintptr_t)site->addr[0]<<" "<<(uintptr_t)site->addr[1]<<endl;
+		}
+	}
+
+	// write the acquisition order inside a merge set, as (held, acquired) member indexes
+	template<typename Iterator>
+	void writeEdges(Iterator begin, Iterator end) {
+		for(Iterator iter = begin; iter != end; iter++) {
+			_deadlockFile<<"> "<<iter->first<<" "<<iter->second<<endl;
+		}
+	}
+
+	// write the call sites of the acquisitions forming the cycles inside a merge set
+	template<typename Iterator>
+	void writeGateSites(Iterator begin, Iterator end) {
+		for(Iterator iter = begin; iter != end; iter++) {
+			if(*iter != NULL) _deadlockFile<<"^ "<<(uintptr_t)*iter<<endl;
+		}
+	}
+
 	// do merge till no merge is required anymore, then write final merge set into file
 	void generateMergeSetInfo() {
 		if(_deadlockReported > 0) {
-			_realMutexMap.initialize(HashFuncs::hashAddr, HashFuncs::compareAddr, xdefines::MAX_SYNC_ITEMS);
+			// current version is a conservative merging
+			mergeSetClosure();
+			buildMergeSetList();
+			// wrintg into file
+			fprintf(stderr, "Recording merge set infomation for deadlock prevention.\n");
+			vector<MergeSetList*> sets;
+			for(MergeSetList* i = _mergeSetList->next; i != NULL; i = i->next) sets.push_back(i);
+			// lay out the members of every set, a set in history is expanded in place
+			map<void*, member_range> ranges;
+			vector<int> historyStart(prevention::getInstance().getMergeSetAmount(), -1);
+			vector<set<pair<int, int> > > edges(sets.size());
+			vector<set<void*> > gateSites(sets.size());
+			for(size_t k = 0; k < sets.size(); k++) {
+				int count = 0;
+				for(MergeSet::iterator iter = sets[k]->mergeSet.begin(); iter != sets[k]->mergeSet.end(); iter++) {
+					int member;
+					int index = getHistoryMember(*iter, &member);
+					if(index < 0) {
+						ranges[*iter] = member_range(k, count++, 1);
+						continue;
+					}
+					special_info_list* sll = prevention::getInstance().getHistorySet(index);
+					if(historyStart[index] < 0) {
+						historyStart[index] = count;
+						gateSites[k].insert(sll->gateSites.begin(), sll->gateSites.end());
+						for(size_t e = 0; e < sll->edges.size(); e++) {
+							edges[k].insert(make_pair(sll->edges[e].first + count, sll->edges[e].second + count));
+						}
+						count += sll->count;
+					}
+					if(member < 0) ranges[*iter] = member_range(k, historyStart[index], sll->count);
+					else ranges[*iter] = member_range(k, historyStart[index] + member, 1);
+				}
+			}
+			// acquisition order inside every set
 			for(DependencyHashMap::iterator iter = _dependencyMap.begin(); iter != _dependencyMap.end(); iter++) {
 				Dependency* dep = iter.getData();
-				_realMutexMap.insertIfAbsent(dep->lock, sizeof(void*), dep->realLock);
-			}
-			bool flag = true; // whether we need to check merge again
-			while(flag) {
-				flag = false; // if we do some merge, the flag will be true and then we will check it all over again
-				// intuitive union
-				mergeSetUnion();
-				// current version is a conservative merging
-				// check every dependency in dependencymap
-				for(DependencyHashMap::iterator iter = _dependencyMap.begin(); iter != _dependencyMap.end(); iter++) {
-					Dependency* dep = iter.getData();
-					if(dep->condRelated) continue;
-					MergeSetList* msl = getRelatedMergeSet(dep->lock);
-					if(msl) {
-						for(int i = 0; i < dep->holdingCount - 1; i++) {
-							if(msl->mergeSet.find(dep->holdingSet[i]) != msl->mergeSet.end()) {
-								// now this dependency is related to a mergeset
-								for(int j = i + 1; j < dep->holdingCount; j++) {
-									if(msl->mergeSet.find(dep->holdingSet[j]) == msl->mergeSet.end()) {
-										// holding other locks between two deadlock-related locks
-										msl->mergeSet.insert(dep->holdingSet[j]);
-										flag = true;
-									}
-								}
-								break;
-							}
+				map<void*, member_range>::iterator to = ranges.find(dep->lock);
+				if(to == ranges.end()) continue;
+				for(int i = 0; i < dep->holdingCount; i++) {
+					map<void*, member_range>::iterator from = ranges.find(dep->holdingSet[i]);
+					if(from == ranges.end() || from->second.set != to->second.set) continue;
+					// where the cycle-forming acquisitions happen
+					for(int c = 0; c < dep->callsiteCount; c++) gateSites[to->second.set].insert(dep->callerAddr[c][0]);
+					for(int c = 0; c < dep->holdingCallsiteCount; c++) {
+						if(dep->holdingCallerIndex[c] == i) gateSites[to->second.set].insert(dep->holdingCallerAddr[c]);
+					}
+					for(int a = from->second.start; a < from->second.start + from->second.count; a++) {
+						for(int b = to->second.start; b < to->second.start + to->second.count; b++) {
+							if(a != b) edges[to->second.set].insert(make_pair(a, b));
 						}
 					}
-					if(flag) break;
 				}
 			}
-			// wrintg into file
-			fprintf(stderr, "Recording merge set infomation for deadlock prevention.\n");
-			for(MergeSetList* i = _mergeSetList->next; i != NULL; i = i->next) {
+			for(size_t k = 0; k < sets.size(); k++) {
 				_deadlockFile<<"-"<<endl;
-				//callstack* myStack;
-				for(MergeSet::iterator iter = i->mergeSet.begin(); iter != i->mergeSet.end(); iter++) {
-					if((INDIRECTION_MASK & (uintptr_t)*iter) == INDIRECTION_MASK) {
-						// a special lock is needed to be merged
-						int index = getSpecialLockIndex(*iter);
-						special_info_list* head = prevention::getInstance().specialList;
-						special_info_list* sll = head->next;
-						while(index-- > 0) {
-							if(sll == NULL) abort();
-							sll = sll->next;
-							head = head->next;
-						}
-						head->next = sll->next;
+				for(MergeSet::iterator iter = sets[k]->mergeSet.begin(); iter != sets[k]->mergeSet.end(); iter++) {
+					int member;
+					int index = getHistoryMember(*iter, &member);
+					if(index >= 0) {
+						// a merge set in history is needed to be merged
+						special_info_list* sll = prevention::getInstance().getHistorySet(index);
+						if(sll->written) continue;
+						sll->written = true;
 						for(auto si = sll->list->next; si != NULL; si = si->next) {
-							_deadlockFile<<" "<<(uintptr_t)si->entry->lock;
-							for(int i = 0; i < si->entry->callsite->found; i++) {
-								_deadlockFile<<" "<<(uintptr_t)si->entry->callsite->stack[i];
-							}
-							_deadlockFile<<"."<<endl;
+							writeSpecialInfo(si->entry);
 						}
 					} else {
 						_deadlockFile<<" "<<(uintptr_t)(*iter);
 						writeCallstack(*iter);
+						writeAcqCallsite(*iter);
 					}
 				}
+				writeEdges(edges[k].begin(), edges[k].end());
+				writeGateSites(gateSites[k].begin(), gateSites[k].end());
 			}
 		}
 		// recover previous history
 		for(special_info_list* sll = prevention::getInstance().specialList->next; sll != NULL; sll = sll->next) {
+			if(sll->written) continue;
 			_deadlockFile<<"-"<<endl;
 			for(auto si = sll->list->next; si != NULL; si = si->next) {
-				_deadlockFile<<" "<<(uintptr_t)si->entry->lock;
-				for(int i = 0; i < si->entry->callsite->found; i++) {
-					_deadlockFile<<" "<<(uintptr_t)si->entry->callsite->stack[i];
-				}
-				_deadlockFile<<"."<<endl;
+				writeSpecialInfo(si->entry);
 			}
+			writeEdges(sll->edges.begin(), sll->edges.end());
+			writeGateSites(sll->gateSites.begin(), sll->gateSites.end());
 		}
 	}
 #endif 
 
 private:
+	// output files are written aside and renamed into place when complete
+	void openOutput(ofstream& file, const string& filename) {
+		file.open((filename + ".tmp").c_str(), ios::trunc);
+	}
+
+	void closeOutput(ofstream& file, const string& filename) {
+		if(!file.is_open()) return;
+		file.close();
+		if(rename((filename + ".tmp").c_str(), filename.c_str()) != 0) fprintf(stderr, "Failed to write %s\n", filename.c_str());
+	}
+
 	std::string exec(const char* cmd) {
 		FILE* pipe = popen(cmd, "r");
 		if (!pipe) return "ERROR";
@@ -583,11 +1215,46 @@ private:
 	typedef HashMap<char*, Dependency*, HeapAllocator> DependencyHashMap;
 	DependencyHashMap _dependencyMap;
 	int _threadIndex; // used index
+	int _pid;
+	size_t _analyzedSeq[xdefines::MAX_THREADS]; // snapshot each thread was analyzed at in current status
 #ifdef REPORTFILE
 	ofstream _reportFile; // report file
+	string _reportFilename;
 #endif
 #ifdef ENABLE_LOG
 	ofstream _logFile; // depdendencies log file
+	string _logFilename;
+#endif
+#ifdef PERIODIC_DETECTION
+	// a record of a thread, as seen by the latest pass of periodic detection
+	struct periodic_record {
+		Dependency* deps;
+		size_t count;
+		size_t mark; // dependencies already taken as roots
+		bool traversed; // in the chain of the search
+	};
+	// a dependency in the chain of the search, and the next candidate to follow it
+	struct periodic_frame {
+		int owner; // record of the dependency
+		int record;
+		size_t dep;
+	};
+	vector<periodic_record> _periodicRecords; // joined ones stay, a reused thread adds a new one
+	map<Dependency*, int> _periodicIndex; // record by its dependencies
+	vector<periodic_frame> _periodicFrames; // the search in progress, resumed by the next pass
+	ChainStack* _periodicStack; // its chain
+	int _periodicNext; // record to take the next root from
+	int _detectSliceMs; // DETECT_SLICE_MS, or UNDEAD_DETECT_SLICE_MS from the environment
+	set<vector<void*> > _periodicCycles; // cycles already reported, by sorted locks
+#endif
+#ifdef WAIT_FOR_GRAPH
+	// per thread blocking acquisition at the last period
+	void* _lastBlockedOn[xdefines::MAX_THREADS];
+	size_t _lastBlockEpoch[xdefines::MAX_THREADS];
+#endif
+#ifdef DEADLOCK_RECOVERY
+	size_t _victimEpoch[xdefines::MAX_THREADS]; // blocking acquisition picked to give up, per thread
+	size_t _deadlockRecovered;
 #endif
 	deadlock_info _deadlockInfo[xdefines::MAX_DEADLOCK];	// record a deadlock basic info. 
 	int _deadlockFound;	// how many different deadlocks we found
@@ -597,9 +1264,25 @@ private:
 #ifdef ENABLE_PREVENTION
 	typedef HashMap<void*, void*, HeapAllocator> RealMutexMap;
 	RealMutexMap _realMutexMap;
-	ofstream _deadlockFile; // deadlock history file
+	ostringstream _deadlockFile; // merge sets of this process, merged into the history file
 	MergeSetList *_mergeSetList;	// merge set list
 	MergeSetList *_mergeSetTail;	// merge set end, aka the insert point
+	typedef HashMap<void*, int, HeapAllocator> LockIdMap;
+	LockIdMap _lockIdMap;	// lock -> union-find id
+	vector<void*> _ufLock;	// id -> lock
+	vector<int> _ufParent;
+	vector<bool> _ufMerged;	// whether the set comes from a reported deadlock
+	vector<vector<int> > _ufMembers;	// ids in a set, only valid for representatives
+	vector<vector<int> > _lockDeps;	// id -> dependencies referring to the lock
+	vector<bool> _depQueued;
+	set<vector<void*> > _journaledCycles; // cycles already in the journal, by sorted locks
+	// members of a lock in the merge set it is written into
+	struct member_range {
+		member_range(int k = 0, int s = 0, int c = 0) : set(k), start(s), count(c) {}
+		int set;
+		int start;
+		int count;
+	};
 #endif
 };
 #endif
@@ -0,0 +1,141 @@
+/* Copyright (C)
+* 2017 - Jinpeng Zhou, Jinpeng.Zhou@utsa.edu
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU General Public License
+* as published by the Free Software Foundation; either version 2
+* of the License, or (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; if not, write to the Free Software
+* Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*
+*/
+/**
+* @file depdump.hh
+* @brief Binary dump of the recorded dependencies, analyzed later by tools/undead-analyze.
+* @author Jinpeng Zhou, Jinpeng.Zhou@utsa.edu
+*/
+#ifndef __DEPDUMP_HH__
+#define __DEPDUMP_HH__
+
+#include <stdio.h>
+#include <limits.h>
+
+#include "xdefines.hh"
+#include "threadstruct.hh"
+
+#define DEP_DUMP_FILE ".deps"
+
+extern char *__progname_full;
+
+// the file starts with it, then every record follows as its count and its dependencies
+struct dep_dump_header {
+	uint32_t magic;
+	uint32_t version;
+	int32_t pid;
+	uint32_t records;
+	// of the history file the merge sets were loaded from, special locks are only valid with it
+	int64_t historySec;
+	int64_t historyNsec;
+	char program[PATH_MAX];
+};
+
+// a dependency without its acquisition call sites, callsiteCount pairs of them follow
+struct dep_dump_entry {
+	void* lock;
+	void* holdingSet[xdefines::MAX_HOLDING_DEPTH];
+	int32_t holdingCount;
+	int32_t condRelated;
+	// the mutex attached to the lock at init, if any
+	int32_t hasRealLock;
+	int32_t specialSlot;
+	int32_t initFound; // depth of the init call stack, -1 without one
+	void* initStack[xdefines::MAX_STACK_DEPTH];
+	int32_t callsiteCount;
+	int32_t holdingCallsiteCount;
+	void* holdingCallerAddr[xdefines::HOLDING_CALLSITE_MAX];
+	int32_t holdingCallerIndex[xdefines::HOLDING_CALLSITE_MAX];
+};
+
+class depdump {
+private:
+	depdump() { }
+
+public:
+	static depdump& getInstance() {
+		static char buf[sizeof(depdump)];
+		static depdump* theOneTrueObject = new (buf) depdump();
+		return *theOneTrueObject;
+	}
+
+	// records are the ones the analysis at exit would take
+	bool write(const char* filename, real_thread_t* records, int amount, struct timespec historyMtime) {
+		FILE* file = fopen(filename, "w");
+		if(file == NULL) {
+			fprintf(stderr, "Failed to create dependency dump %s\n", filename);
+			return false;
+		}
+		dep_dump_header header;
+		memset(&header, 0, sizeof(header));
+		header.magic = xdefines::DEP_DUMP_MAGIC;
+		header.version = xdefines::DEP_DUMP_VERSION;
+		header.pid = getpid();
+		header.records = amount;
+		header.historySec = historyMtime.tv_sec;
+		header.historyNsec = historyMtime.tv_nsec;
+		strncpy(header.program, __progname_full, sizeof(header.program) - 1);
+		bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+		size_t total = 0;
+		for(int i = 0; i < amount && ok; i++) {
+			uint64_t count = records[i].depCount;
+			ok = fwrite(&count, sizeof(count), 1, file) == 1;
+			for(size_t j = 0; j < count && ok; j++) {
+				ok = writeDependency(file, &records[i].dependencies[j]);
+			}
+			total += count;
+		}
+		if(fclose(file) != 0) ok = false;
+		if(!ok) {
+			fprintf(stderr, "Failed to write dependency dump %s\n", filename);
+			return false;
+		}
+		fprintf(stderr, "Dumped %zu dependencies of %d threads into %s\n", total, amount, filename);
+		return true;
+	}
+
+private:
+	bool writeDependency(FILE* file, Dependency* dep) {
+		dep_dump_entry entry;
+		memset(&entry, 0, sizeof(entry));
+		entry.lock = dep->lock;
+		entry.holdingCount = dep->holdingCount;
+		memcpy(entry.holdingSet, dep->holdingSet, dep->holdingCount * sizeof(void*));
+		entry.specialSlot = -1;
+		entry.initFound = -1;
+#ifdef ENABLE_PREVENTION
+		entry.condRelated = dep->condRelated;
+		my_mutex* real = (my_mutex*)dep->realLock;
+		if(real != NULL) {
+			entry.hasRealLock = 1;
+			entry.specialSlot = real->specialSlot;
+			if(real->callsite != NULL) {
+				entry.initFound = real->callsite->found;
+				memcpy(entry.initStack, real->callsite->stack, sizeof(entry.initStack));
+			}
+		}
+#endif
+		entry.callsiteCount = dep->callsiteCount;
+		entry.holdingCallsiteCount = dep->holdingCallsiteCount;
+		memcpy(entry.holdingCallerAddr, dep->holdingCallerAddr, sizeof(entry.holdingCallerAddr));
+		memcpy(entry.holdingCallerIndex, dep->holdingCallerIndex, sizeof(entry.holdingCallerIndex));
+		if(fwrite(&entry, sizeof(entry), 1, file) != 1) return false;
+		if(dep->callsiteCount == 0) return true;
+		return fwrite(dep->callerAddr, sizeof(dep->callerAddr[0]), dep->callsiteCount, file) == (size_t)dep->callsiteCount;
+	}
+};
+#endif
@@ -0,0 +1,295 @@
+/* Copyright (C)
+* 2017 - Jinpeng Zhou, Jinpeng.Zhou@utsa.edu
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU General Public License
+* as published by the Free Software Foundation; either version 2
+* of the License, or (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; if not, write to the Free Software
+* Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*
+*/
+/**
+* @file history.hh
+* @brief Deadlock history file shared by all processes of a program.
+* @author Jinpeng Zhou, Jinpeng.Zhou@utsa.edu
+*/
+#ifndef __HISTORY_HH__
+#define __HISTORY_HH__
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <sys/file.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include <set>
+#include <map>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+#include "xdefines.hh"
+
+using namespace std;
+
+// a lock of a cycle found during execution
+struct journal_lock {
+	void* lock;
+	int found; // depth of the init call stack
+	int sites; // how many acquisition call sites
+	void* stack[xdefines::MAX_STACK_DEPTH];
+	void* site[xdefines::JOURNAL_SITE_MAX][xdefines::CALLSITE_LEVEL];
+};
+
+// a cycle, appended to the journal by one write().
+// A torn record at the end is dropped by its checksum.
+struct journal_record {
+	uint32_t magic;
+	uint32_t count; // how many locks in the cycle
+	journal_lock locks[xdefines::JOURNAL_CYCLE_MAX];
+	uint64_t checksum;
+};
+
+/*
+ * Every process writing its history holds an exclusive file lock, merges what other
+ * processes wrote in the meantime, and replaces the file with a rename.
+ * Readers never take the lock, they see either the old or the new file.
+ */
+class history {
+public:
+	// merge content into the history file, return false if the file is not replaced
+	static bool store(const char* filename, const string& content) {
+		string lockFilename = string(filename) + ".lock";
+		int fd = open(lockFilename.c_str(), O_RDWR | O_CREAT, 0644);
+		if(fd < 0 || flock(fd, LOCK_EX) != 0) {
+			fprintf(stderr, "Failed to lock %s\n", lockFilename.c_str());
+			if(fd >= 0) close(fd);
+			return false;
+		}
+		vector<merge_set> sets;
+		// sets of this process go first, so that they keep their positions
+		istringstream current(content);
+		parse(current, sets);
+		ifstream previous(filename);
+		if(previous.is_open()) parse(previous, sets);
+		previous.close();
+
+		char pidBuf[16];
+		sprintf(pidBuf, ".%d", getpid());
+		string tmpFilename = string(filename) + pidBuf;
+		ofstream out(tmpFilename.c_str(), ios::trunc);
+		writeSets(out, compact(sets));
+		out.close();
+		bool stored = !out.fail() && rename(tmpFilename.c_str(), filename) == 0;
+		if(!stored) {
+			fprintf(stderr, "Failed to replace %s\n", filename);
+			unlink(tmpFilename.c_str());
+		}
+		flock(fd, LOCK_UN);
+		close(fd);
+		return stored;
+	}
+
+	// append a cycle to the journal, and flush it before the process may die
+	static bool appendJournal(const char* filename, journal_record* record) {
+		record->magic = xdefines::JOURNAL_MAGIC;
+		record->checksum = getChecksum(record);
+		int fd = open(filename, O_WRONLY | O_APPEND | O_CREAT, 0644);
+		if(fd < 0) return false;
+		flock(fd, LOCK_EX);
+		bool written = write(fd, record, sizeof(journal_record)) == sizeof(journal_record);
+		fdatasync(fd);
+		flock(fd, LOCK_UN);
+		close(fd);
+		return written;
+	}
+
+	// turn the cycles in the journal into merge sets of the history file, then empty the journal
+	static void foldJournal(const char* journalFilename, const char* filename) {
+		int fd = open(journalFilename, O_RDWR);
+		if(fd < 0) return;
+		flock(fd, LOCK_EX);
+		ostringstream content;
+		journal_record record;
+		int folded = 0;
+		while(read(fd, &record, sizeof(journal_record)) == sizeof(journal_record)) {
+			if(record.magic != xdefines::JOURNAL_MAGIC || record.checksum != getChecksum(&record)) break;
+			if(record.count == 0 || record.count > xdefines::JOURNAL_CYCLE_MAX) continue;
+			writeCycle(content, &record);
+			folded++;
+		}
+		if(folded == 0 || store(filename, content.str())) {
+			if(ftruncate(fd, 0) != 0) fprintf(stderr, "Failed to empty %s\n", journalFilename);
+		}
+		flock(fd, LOCK_UN);
+		close(fd);
+	}
+
+	// the locks of the cycle make a merge set, the i-th one is held when acquiring the next one
+	static void writeCycle(ostream& out, journal_record* record) {
+		out<<"-"<<endl;
+		for(uint32_t i = 0; i < record->count; i++) {
+			journal_lock* jl = &record->locks[i];
+			out<<" "<<(uintptr_t)jl->lock;
+			for(int s = 0; s < jl->found && s < xdefines::MAX_STACK_DEPTH; s++) out<<" "<<(uintptr_t)jl->stack[s];
+			out<<"."<<endl;
+			for(int s = 0; s < jl->sites && s < xdefines::JOURNAL_SITE_MAX; s++) {
+				out<<"@ "<<(uintptr_t)jl->site[s][0]<<" "<<(uintptr_t)jl->site[s][1]<<endl;
+			}
+		}
+		for(uint32_t i = 0; i < record->count; i++) out<<"> "<<i<<" "<<(i + 1) % record->count<<endl;
+		for(uint32_t i = 0; i < record->count; i++) {
+			journal_lock* jl = &record->locks[i];
+			for(int s = 0; s < jl->sites && s < xdefines::JOURNAL_SITE_MAX; s++) out<<"^ "<<(uintptr_t)jl->site[s][0]<<endl;
+		}
+	}
+
+private:
+	static uint64_t getChecksum(journal_record* record) {
+		// FNV-1a over everything but the checksum
+		uint64_t hash = 0xcbf29ce484222325UL;
+		unsigned char* bytes = (unsigned char*)record;
+		for(size_t i = 0; i < offsetof(journal_record, checksum); i++) {
+			hash ^= bytes[i];
+			hash *= 0x100000001b3UL;
+		}
+		return hash;
+	}
+
+	struct member {
+		string key; // the same lock in every set and run
+		string lockLine; // with its init call stack
+		vector<string> acqLines; // its acquisition call sites, of all runs
+	};
+
+	struct merge_set {
+		vector<member> members;
+		set<pair<int, int> > edges; // (held, acquired) member indexes
+		set<uintptr_t> gateSites;
+	};
+
+	// a lock is matched by its init call stack, or by its address without one.
+	// Its acquisition call sites vary from run to run, they are only added up.
+	static string memberKey(const string& lockLine) {
+		string line = lockLine.substr(0, lockLine.size() - 1); // without the '.'
+		size_t stack = line.find(' ', 1);
+		if(stack != string::npos) return "s" + line.substr(stack);
+		return "l" + line;
+	}
+
+	static void addAcqLines(member* mb, const vector<string>& acqLines) {
+		for(size_t i = 0; i < acqLines.size(); i++) {
+			if(find(mb->acqLines.begin(), mb->acqLines.end(), acqLines[i]) == mb->acqLines.end()) mb->acqLines.push_back(acqLines[i]);
+		}
+	}
+
+	static void parse(istream& in, vector<merge_set>& sets) {
+		merge_set* ms = NULL;
+		string line;
+		while(getline(in, line)) {
+			if(line.empty()) continue;
+			if(line[0] == '-') {
+				sets.push_back(merge_set());
+				ms = &sets.back();
+			} else if(ms == NULL) {
+				continue;
+			} else if(line[0] == ' ') {
+				ms->members.push_back(member());
+				ms->members.back().lockLine = line;
+				ms->members.back().key = memberKey(line);
+			} else if(line[0] == '@') {
+				if(ms->members.empty()) continue;
+				addAcqLines(&ms->members.back(), vector<string>(1, line));
+			} else if(line[0] == '>') {
+				int held = -1;
+				int acquired = -1;
+				sscanf(line.c_str(), "> %d %d", &held, &acquired);
+				if(held >= 0 && acquired >= 0) ms->edges.insert(make_pair(held, acquired));
+			} else if(line[0] == '^') {
+				unsigned long site = 0;
+				sscanf(line.c_str(), "^ %lu", &site);
+				if(site != 0) ms->gateSites.insert(site);
+			}
+		}
+	}
+
+	static int findSet(vector<int>& parent, int i) {
+		while(parent[i] != i) i = parent[i] = parent[parent[i]];
+		return i;
+	}
+
+	// sets sharing a lock are unioned, so duplicated and subsumed sets disappear
+	static vector<merge_set> compact(vector<merge_set>& sets) {
+		vector<int> parent(sets.size());
+		for(size_t i = 0; i < sets.size(); i++) parent[i] = i;
+		map<string, int> owner;
+		for(size_t i = 0; i < sets.size(); i++) {
+			for(size_t m = 0; m < sets[i].members.size(); m++) {
+				map<string, int>::iterator iter = owner.find(sets[i].members[m].key);
+				if(iter == owner.end()) owner[sets[i].members[m].key] = i;
+				else parent[findSet(parent, i)] = findSet(parent, iter->second);
+			}
+		}
+		// a unioned set takes the position of its 1st set
+		vector<merge_set> result;
+		vector<int> position(sets.size(), -1);
+		vector<map<string, int> > index;
+		for(size_t i = 0; i < sets.size(); i++) {
+			int root = findSet(parent, i);
+			if(position[root] < 0) {
+				position[root] = result.size();
+				result.push_back(merge_set());
+				index.push_back(map<string, int>());
+			}
+			merge_set& to = result[position[root]];
+			map<string, int>& toIndex = index[position[root]];
+			vector<int> renumber(sets[i].members.size());
+			for(size_t m = 0; m < sets[i].members.size(); m++) {
+				member& mb = sets[i].members[m];
+				map<string, int>::iterator iter = toIndex.find(mb.key);
+				if(iter != toIndex.end()) {
+					renumber[m] = iter->second;
+					addAcqLines(&to.members[iter->second], mb.acqLines);
+					continue;
+				}
+				renumber[m] = toIndex[mb.key] = to.members.size();
+				to.members.push_back(mb);
+			}
+			for(set<pair<int, int> >::iterator e = sets[i].edges.begin(); e != sets[i].edges.end(); e++) {
+				if(e->first >= (int)renumber.size() || e->second >= (int)renumber.size()) continue;
+				int held = renumber[e->first];
+				int acquired = renumber[e->second];
+				if(held != acquired) to.edges.insert(make_pair(held, acquired));
+			}
+			to.gateSites.insert(sets[i].gateSites.begin(), sets[i].gateSites.end());
+		}
+		return result;
+	}
+
+	static void writeSets(ostream& out, const vector<merge_set>& sets) {
+		for(size_t i = 0; i < sets.size(); i++) {
+			out<<"-"<<endl;
+			for(size_t m = 0; m < sets[i].members.size(); m++) {
+				const member& mb = sets[i].members[m];
+				out<<mb.lockLine<<endl;
+				for(size_t a = 0; a < mb.acqLines.size(); a++) out<<mb.acqLines[a]<<endl;
+			}
+			for(set<pair<int, int> >::const_iterator e = sets[i].edges.begin(); e != sets[i].edges.end(); e++) {
+				out<<"> "<<e->first<<" "<<e->second<<endl;
+			}
+			for(set<uintptr_t>::const_iterator s = sets[i].gateSites.begin(); s != sets[i].gateSites.end(); s++) {
+				out<<"^ "<<*s<<endl;
+			}
+		}
+	}
+};
+#endif
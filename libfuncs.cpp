@@ -37,6 +37,7 @@ int (*WRAP(pthread_mutex_destroy))(pthread_mutex_t*);
 int (*WRAP(pthread_mutex_lock))(pthread_mutex_t*);
 int (*WRAP(pthread_mutex_unlock))(pthread_mutex_t*);
 int (*WRAP(pthread_mutex_trylock))(pthread_mutex_t*);
+int (*WRAP(pthread_mutex_timedlock))(pthread_mutex_t*, const struct timespec*);
 
 int (*WRAP(pthread_cond_timedwait))(pthread_cond_t*, pthread_mutex_t*,const struct timespec*);
 int (*WRAP(pthread_cond_wait))(pthread_cond_t*, pthread_mutex_t*);
@@ -63,6 +64,7 @@ void init_real_functions() {
 	SET_WRAPPED(pthread_mutex_lock, pthread_handle);
 	SET_WRAPPED(pthread_mutex_unlock, pthread_handle);
 	SET_WRAPPED(pthread_mutex_trylock, pthread_handle);
+	SET_WRAPPED(pthread_mutex_timedlock, pthread_handle);
 
 	SET_WRAPPED(pthread_cond_timedwait, pthread_handle);
 	SET_WRAPPED(pthread_cond_wait, pthread_handle);
@@ -35,6 +35,7 @@ extern int (*WRAP(pthread_mutex_destroy))(pthread_mutex_t*);
 extern int (*WRAP(pthread_mutex_lock))(pthread_mutex_t*);
 extern int (*WRAP(pthread_mutex_unlock))(pthread_mutex_t*);
 extern int (*WRAP(pthread_mutex_trylock))(pthread_mutex_t*);
+extern int (*WRAP(pthread_mutex_timedlock))(pthread_mutex_t*, const struct timespec*);
 
 extern int (*WRAP(pthread_cond_timedwait))(pthread_cond_t*, pthread_mutex_t*, const struct timespec*);
 extern int (*WRAP(pthread_cond_wait))(pthread_cond_t*, pthread_mutex_t*);
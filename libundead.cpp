@@ -51,6 +51,22 @@ size_t realMutexIndex;
 bool enablePrevention;
 #endif
 
+#ifdef MONITOR_EVENTFD
+int monitorEvent = -1; // eventfd waking the monitor thread
+#endif
+#ifdef ON_DEMAND_REPORT
+bool reportRequested; // set by SIGUSR2
+#endif
+
+#ifdef DEADLOCK_RECOVERY
+recovery_handler recoveryHandler;
+
+// registered by the application to take care of the victims of deadlocks
+extern "C" void undead_set_recovery_handler(recovery_handler handler) {
+	__atomic_store_n(&recoveryHandler, handler, __ATOMIC_RELEASE);
+}
+#endif
+
 void initializer (void) {
 	// wrap functions
 	init_real_functions();
@@ -122,7 +138,14 @@ int pthread_join(pthread_t tid, void** retval) {
 int pthread_mutex_destroy (pthread_mutex_t* mutex) {
 #ifdef ENABLE_PREVENTION
 	pthread_mutex_t* real_mutex = (pthread_mutex_t*)getSyncEntry(mutex);
-	return WRAP(pthread_mutex_destroy)(real_mutex);
+	if(real_mutex == mutex) prevention::getInstance().forgetMiss(mutex);
+	int ret = WRAP(pthread_mutex_destroy)(real_mutex);
+#ifdef ORDERED_PREVENTION
+	// a member of an ordered set, not held by anyone as it's destroyed
+	if(ret == 0 && enablePrevention && real_mutex != mutex && !prevention::getInstance().checkInDirection(real_mutex)
+		&& ((my_mutex*)real_mutex)->specialSlot >= 0) prevention::getInstance().unbindMember(((my_mutex*)real_mutex)->specialSlot, mutex);
+#endif
+	return ret;
 #else
 	return WRAP(pthread_mutex_destroy)(mutex);	
 #endif
@@ -130,6 +153,10 @@ int pthread_mutex_destroy (pthread_mutex_t* mutex) {
 
 int pthread_mutex_init(pthread_mutex_t* mutex, const pthread_mutexattr_t* attr) {
 	int ret;
+#ifdef LOCK_CLASS
+	// the class of a lock is decided by where it is initialized
+	lockclass::getInstance().setClass(mutex, __builtin_return_address(0));
+#endif
 #ifdef ENABLE_PREVENTION
 	// get thread index
 	int index = getThreadIndexFromStack((uintptr_t)&mutex);
@@ -144,6 +171,7 @@ int pthread_mutex_init(pthread_mutex_t* mutex, const pthread_mutexattr_t* attr)
 	}
 	uintptr_t redirect = 0; // previous redirection result
 #ifndef DISABLE_INIT_CHECK
+	int slot = -1; // member slot of previous redirection
 	unsigned long esp;
 	GET_ESP(esp);
 	OffsetHashMap * offsetMap = current->initOffsetMap;
@@ -156,12 +184,18 @@ int pthread_mutex_init(pthread_mutex_t* mutex, const pthread_mutexattr_t* attr)
 		oil = new OffsetInfoList;
 		offsetMap->insert(combined, 8, oil);
 	} else {
-		if(oil->hasEntry(offset, mutex, &redirect)) {
+		if(oil->hasEntry(offset, mutex, &redirect, &slot)) {
 			// already exit, don't care call stacks
 			// directly do redirection and return, based on previous result
-			if(redirect == 0) return WRAP(pthread_mutex_init)(real_mutex, attr); 
-			else *(uintptr_t*)real_mutex = (uintptr_t)redirect;
-			return 0;
+			if(redirect == 0) ret = WRAP(pthread_mutex_init)(real_mutex, attr);
+			else {
+				*(uintptr_t*)real_mutex = (uintptr_t)redirect;
+				prevention::getInstance().countMapped((void*)redirect);
+			}
+			((my_mutex*)real_mutex)->specialSlot = slot;
+			// a member of an ordered or gated set
+			if(redirect == 0 && slot >= 0) prevention::getInstance().bindMember(slot, mutex);
+			return redirect == 0 ? ret : 0;
 		}
 	}
 #endif
@@ -170,15 +204,21 @@ int pthread_mutex_init(pthread_mutex_t* mutex, const pthread_mutexattr_t* attr)
 	current->isRecursive = true;
 	int len = backtrace(addr, xdefines::MAX_BACKTRACE_DEPTH);
 	current->isRecursive = false;
+	LIVE_STAT(current, backtraces);
 	// initialize the real mutex
 	if(enablePrevention) {
 		ret = prevention::getInstance().mutex_init(mutex, real_mutex, attr, current, addr, len, &redirect);
+#ifndef DISABLE_INIT_CHECK
+		slot = ((my_mutex*)real_mutex)->specialSlot;
+#endif
 	} else {
+		// prevention may be enabled later by a reload
+		((my_mutex*)real_mutex)->specialSlot = -1;
 		ret = WRAP(pthread_mutex_init)(real_mutex, attr);
 	}
 	
 #ifndef DISABLE_INIT_CHECK
-	oil->insertToTail(new OffsetInfo(offset, mutex, redirect));
+	oil->insertToTail(new OffsetInfo(offset, mutex, redirect, slot));
 #endif
 
 #ifdef ENABLE_ANALYZER
@@ -195,52 +235,91 @@ int pthread_mutex_init(pthread_mutex_t* mutex, const pthread_mutexattr_t* attr)
 	return ret;
 }
 
-int pthread_mutex_lock(pthread_mutex_t *mutex) {
-	int index = getThreadIndexFromStack((uintptr_t)&mutex);
-	thread_t * current = &threadsInfo[index];
-	if(current->isRecursive) return WRAP(pthread_mutex_lock)(mutex);
+static INLINE int mutexLock(thread_t* current, pthread_mutex_t* mutex) {
 #ifdef ENABLE_PREVENTION
 	// get corresponding real_mutex
 	pthread_mutex_t* real_mutex = (pthread_mutex_t*)getSyncEntry(mutex);
 	if(enablePrevention) { // or we can skip checking enablePrevention
+		if(real_mutex == mutex) real_mutex = prevention::getInstance().mutex_acquire(mutex, current);
 		if(prevention::getInstance().checkInDirection(real_mutex)) {
 			// this is a special lock with redirection
 			pthread_mutex_t *realMutex = (pthread_mutex_t*)(*(uintptr_t*)real_mutex);
+			LIVE_STAT(current, redirectedAcquisitions);
 			// record
-			if(!updateSpecialByLock(current, realMutex, mutex)) return 0;
+			if(!updateSpecialByLock(current, realMutex, (my_mutex*)real_mutex)) return 0;
 			if(!isSingleThread) updateDependency(current, realMutex);	
-			return WRAP(pthread_mutex_lock)(realMutex);
+#ifdef WAIT_FOR_GRAPH
+			publishBlocked(current, realMutex);
+			int ret = prevention::getInstance().special_lock(realMutex);
+			clearBlocked(current);
+			if(ret == EDEADLK) {
+				// gave up as the victim of a deadlock
+				updateSpecialByUnLock(current, realMutex, (my_mutex*)real_mutex);
+				updateHoldingSetByUnlock(current, realMutex);
+			}
+			return ret;
+#else
+			return prevention::getInstance().special_lock(realMutex);
+#endif
+#ifdef KEEP_MEMBER_MUTEX
+		} else if(real_mutex != mutex && ((my_mutex*)real_mutex)->specialSlot >= 0) {
+			// a member of an ordered or gated set
+			return prevention::getInstance().member_lock(current, mutex, real_mutex, __builtin_return_address(0));
+#endif
 		} else {
 			// this is not a special lock
 			if(!isSingleThread) updateDependency(current, mutex);
-			return WRAP(pthread_mutex_lock)(real_mutex);
+			return acquireBlocking(current, mutex, real_mutex);
 		}
 	} else {
 		if(!isSingleThread) updateDependency(current, mutex);	
-		return WRAP(pthread_mutex_lock)(real_mutex);
+		return acquireBlocking(current, mutex, real_mutex);
 	}
 #else
 	if(!isSingleThread) updateDependency(current, mutex);	
 	// Acquire the actual mutex.
-	return WRAP(pthread_mutex_lock)(mutex);
+	return acquireBlocking(current, mutex, mutex);
 #endif
 }
 
-int pthread_mutex_trylock(pthread_mutex_t *mutex) {
-	int ret;
+int pthread_mutex_lock(pthread_mutex_t *mutex) {
 	int index = getThreadIndexFromStack((uintptr_t)&mutex);
 	thread_t * current = &threadsInfo[index];
-	if(current->isRecursive) return WRAP(pthread_mutex_trylock)(mutex);
+	if(current->isRecursive) return WRAP(pthread_mutex_lock)(mutex);
+	LIVE_STAT(current, lockCalls);
+#ifdef LOCK_PROFILE
+	lock_wait wait = lockprofile::getInstance().waiting(mutex, index);
+#endif
+	int ret = mutexLock(current, mutex);
+	if(ret == 0) {
+#ifdef LOCK_PROFILE
+		lockprofile::getInstance().acquired(&wait, index, __builtin_return_address(0));
+#endif
+#ifdef ENABLE_TRACE
+		traceEvent(current->trace, TRACE_LOCK, mutex, __builtin_return_address(0));
+#endif
+	}
+	return ret;
+}
+
+static INLINE int mutexTrylock(thread_t* current, pthread_mutex_t* mutex) {
+	int ret;
 #ifdef ENABLE_PREVENTION
 	pthread_mutex_t* real_mutex = (pthread_mutex_t*)getSyncEntry(mutex);
 	if(enablePrevention) {
+		if(real_mutex == mutex) real_mutex = prevention::getInstance().mutex_acquire(mutex, current);
 		if(prevention::getInstance().checkInDirection(real_mutex)) {
 			pthread_mutex_t *realMutex = (pthread_mutex_t*)(*(uintptr_t*)real_mutex);
-			ret = WRAP(pthread_mutex_trylock)(realMutex);
+			ret = prevention::getInstance().special_trylock(realMutex);
 			if(ret == 0) {
-				if(!updateSpecialByLock(current, realMutex, mutex)) return 0;
+				LIVE_STAT(current, redirectedAcquisitions);
+				if(!updateSpecialByLock(current, realMutex, (my_mutex*)real_mutex)) return 0;
 				if(!isSingleThread) updateDependencyByTryLock(current, realMutex);
 			}
+#ifdef KEEP_MEMBER_MUTEX
+		} else if(real_mutex != mutex && ((my_mutex*)real_mutex)->specialSlot >= 0) {
+			ret = prevention::getInstance().member_trylock(current, mutex, real_mutex);
+#endif
 		} else {
 			ret = WRAP(pthread_mutex_trylock)(real_mutex);
 			if(ret == 0 && !isSingleThread) updateDependencyByTryLock(current, mutex);	
@@ -256,19 +335,50 @@ int pthread_mutex_trylock(pthread_mutex_t *mutex) {
 	return ret;
 }
 
+int pthread_mutex_trylock(pthread_mutex_t *mutex) {
+	int index = getThreadIndexFromStack((uintptr_t)&mutex);
+	thread_t * current = &threadsInfo[index];
+	if(current->isRecursive) return WRAP(pthread_mutex_trylock)(mutex);
+	LIVE_STAT(current, trylockCalls);
+#ifdef LOCK_PROFILE
+	lock_wait wait = lockprofile::getInstance().waiting(mutex, index);
+#endif
+	int ret = mutexTrylock(current, mutex);
+	if(ret == 0) {
+#ifdef LOCK_PROFILE
+		lockprofile::getInstance().acquired(&wait, index, __builtin_return_address(0));
+#endif
+#ifdef ENABLE_TRACE
+		traceEvent(current->trace, TRACE_TRYLOCK, mutex, __builtin_return_address(0));
+#endif
+	}
+	return ret;
+}
+
 int pthread_mutex_unlock(pthread_mutex_t* mutex) {
 	int ret;
 	int index = getThreadIndexFromStack((uintptr_t)&mutex);
 	thread_t * current = &threadsInfo[index];
 	if(current->isRecursive) return WRAP(pthread_mutex_unlock)(mutex);;
+	LIVE_STAT(current, unlockCalls);
+#ifdef LOCK_PROFILE
+	lockprofile::getInstance().releasing(mutex, index);
+#endif
+#ifdef ENABLE_TRACE
+	traceEvent(current->trace, TRACE_UNLOCK, mutex, __builtin_return_address(0));
+#endif
 #ifdef ENABLE_PREVENTION
 	pthread_mutex_t* real_mutex = (pthread_mutex_t*)getSyncEntry(mutex);
 	if(enablePrevention) {
 		if(prevention::getInstance().checkInDirection(real_mutex)) {
 			pthread_mutex_t *realMutex = (pthread_mutex_t*)(*(uintptr_t*)real_mutex);
-			if(index != 0 && !updateSpecialByUnLock(current, realMutex, mutex)) return 0;
-			ret = WRAP(pthread_mutex_unlock)(realMutex);
+			if(!updateSpecialByUnLock(current, realMutex, (my_mutex*)real_mutex)) return 0;
+			ret = prevention::getInstance().special_unlock(realMutex);
 			if(!isSingleThread && ret == 0) updateHoldingSetByUnlock(current, realMutex);
+#ifdef KEEP_MEMBER_MUTEX
+		} else if(real_mutex != mutex && ((my_mutex*)real_mutex)->specialSlot >= 0) {
+			ret = prevention::getInstance().member_unlock(current, mutex, real_mutex);
+#endif
 		} else {
 			ret = WRAP(pthread_mutex_unlock)(real_mutex);
 			if(!isSingleThread && ret == 0) updateHoldingSetByUnlock(current, mutex);
@@ -284,7 +394,7 @@ int pthread_mutex_unlock(pthread_mutex_t* mutex) {
 	return ret;
 }
 
-int pthread_cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex) {
+static INLINE int condWait(pthread_cond_t* cond, pthread_mutex_t* mutex) {
 #ifdef ENABLE_PREVENTION
 	int index = getThreadIndexFromStack((uintptr_t)&mutex);
 	thread_t * current = &threadsInfo[index];
@@ -296,6 +406,10 @@ int pthread_cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex) {
 			return WRAP(pthread_cond_wait)(cond, realMutex);
 		} else {
 			updateDependencyWithCond(current, mutex);
+#ifdef KEEP_MEMBER_MUTEX
+			// a member of an ordered or gated set
+			if(real_mutex != mutex && ((my_mutex*)real_mutex)->specialSlot >= 0) return prevention::getInstance().member_wait(current, cond, mutex, real_mutex, NULL);
+#endif
 			return WRAP(pthread_cond_wait)(cond, real_mutex);
 		}
 	} else {
@@ -307,7 +421,27 @@ int pthread_cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex) {
 #endif
 }
 
-int pthread_cond_timedwait(pthread_cond_t* cond, pthread_mutex_t* mutex, const struct timespec * abstime) {
+int pthread_cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex) {
+#if defined(LOCK_PROFILE) || defined(ENABLE_TRACE)
+	int index = getThreadIndexFromStack((uintptr_t)&mutex);
+#endif
+#ifdef LOCK_PROFILE
+	int depth = lockprofile::getInstance().suspend(mutex, index);
+#endif
+#ifdef ENABLE_TRACE
+	traceEvent(threadsInfo[index].trace, TRACE_COND_WAIT, mutex, __builtin_return_address(0));
+#endif
+	int ret = condWait(cond, mutex);
+#ifdef ENABLE_TRACE
+	traceEvent(threadsInfo[index].trace, TRACE_COND_WAKE, mutex, __builtin_return_address(0));
+#endif
+#ifdef LOCK_PROFILE
+	lockprofile::getInstance().resume(mutex, index, depth);
+#endif
+	return ret;
+}
+
+static INLINE int condTimedwait(pthread_cond_t* cond, pthread_mutex_t* mutex, const struct timespec * abstime) {
 #ifdef ENABLE_PREVENTION
 	int index = getThreadIndexFromStack((uintptr_t)&mutex);
 	thread_t * current = &threadsInfo[index];
@@ -319,6 +453,10 @@ int pthread_cond_timedwait(pthread_cond_t* cond, pthread_mutex_t* mutex, const s
 			return WRAP(pthread_cond_timedwait)(cond, realMutex, abstime);
 		} else {
 			updateDependencyWithCond(current, mutex);
+#ifdef KEEP_MEMBER_MUTEX
+			// a member of an ordered or gated set
+			if(real_mutex != mutex && ((my_mutex*)real_mutex)->specialSlot >= 0) return prevention::getInstance().member_wait(current, cond, mutex, real_mutex, abstime);
+#endif
 			return WRAP(pthread_cond_timedwait)(cond, real_mutex, abstime);
 		}
 	} else {
@@ -329,3 +467,23 @@ int pthread_cond_timedwait(pthread_cond_t* cond, pthread_mutex_t* mutex, const s
 	return WRAP(pthread_cond_timedwait)(cond, mutex, abstime);
 #endif
 }
+
+int pthread_cond_timedwait(pthread_cond_t* cond, pthread_mutex_t* mutex, const struct timespec * abstime) {
+#if defined(LOCK_PROFILE) || defined(ENABLE_TRACE)
+	int index = getThreadIndexFromStack((uintptr_t)&mutex);
+#endif
+#ifdef LOCK_PROFILE
+	int depth = lockprofile::getInstance().suspend(mutex, index);
+#endif
+#ifdef ENABLE_TRACE
+	traceEvent(threadsInfo[index].trace, TRACE_COND_WAIT, mutex, __builtin_return_address(0));
+#endif
+	int ret = condTimedwait(cond, mutex, abstime);
+#ifdef ENABLE_TRACE
+	traceEvent(threadsInfo[index].trace, TRACE_COND_WAKE, mutex, __builtin_return_address(0));
+#endif
+#ifdef LOCK_PROFILE
+	lockprofile::getInstance().resume(mutex, index, depth);
+#endif
+	return ret;
+}
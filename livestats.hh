@@ -0,0 +1,118 @@
+/* Copyright (C)
+* 2017 - Jinpeng Zhou, Jinpeng.Zhou@utsa.edu
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU General Public License
+* as published by the Free Software Foundation; either version 2
+* of the License, or (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; if not, write to the Free Software
+* Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*
+*/
+/**
+* @file livestats.hh
+* @brief Per-thread counters in a shared memory segment, read by tools/undead-stat.
+* @author Jinpeng Zhou, Jinpeng.Zhou@utsa.edu
+*/
+#ifndef __LIVESTATS_HH__
+#define __LIVESTATS_HH__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <new>
+
+// the segment is /dev/shm/undead-stats.<pid>
+#define LIVE_STATS_NAME "/undead-stats.%d"
+#define LIVE_STATS_MAGIC 0x54534e55
+#define LIVE_STATS_VERSION 1
+
+// counters of a thread record, only ever written by the thread using the record.
+// Cachelines are never shared between records.
+struct alignas(64) thread_stats {
+	int32_t tid; // of the last thread using the record
+	int32_t active;
+	uint64_t lockCalls;
+	uint64_t trylockCalls;
+	uint64_t unlockCalls;
+	uint64_t nestedAcquisitions; // acquisitions with locks held
+	uint64_t newDependencies;
+	uint64_t backtraces; // call stacks captured
+	uint64_t callsiteHits; // nested acquisitions whose call site was already recorded
+	uint64_t hashProbes; // lookups in the per-thread dependency and call site maps
+	uint64_t redirectedAcquisitions; // acquisitions of special locks
+};
+
+struct alignas(64) live_stats_header {
+	uint32_t magic;
+	uint32_t version;
+	int32_t pid;
+	uint32_t capacity; // thread records following the header
+};
+
+class livestats {
+private:
+	livestats() { }
+
+public:
+	static livestats& getInstance() {
+		static char buf[sizeof(livestats)];
+		static livestats* theOneTrueObject = new (buf) livestats();
+		return *theOneTrueObject;
+	}
+
+	// a private mapping if the segment can't be created, so that counting never checks
+	void initialize(int capacity) {
+		snprintf(_name, sizeof(_name), LIVE_STATS_NAME, getpid());
+		_size = sizeof(live_stats_header) + capacity * sizeof(thread_stats);
+		_header = NULL;
+		int fd = shm_open(_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if(fd >= 0) {
+			if(ftruncate(fd, _size) == 0) {
+				void* ptr = mmap(NULL, _size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+				if(ptr != MAP_FAILED) _header = (live_stats_header*)ptr;
+			}
+			close(fd);
+			if(_header == NULL) shm_unlink(_name);
+		}
+		if(_header == NULL) {
+			fprintf(stderr, "Failed to create /dev/shm%s, live statistics are not exported\n", _name);
+			_name[0] = '\0';
+			_header = (live_stats_header*)mmap(NULL, _size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		}
+		_stats = (thread_stats*)(_header + 1);
+		_header->pid = getpid();
+		_header->capacity = capacity;
+		_header->version = LIVE_STATS_VERSION;
+		// readers check the magic last
+		__atomic_store_n(&_header->magic, (uint32_t)LIVE_STATS_MAGIC, __ATOMIC_RELEASE);
+	}
+
+	void finalize() {
+		if(_name[0] != '\0') shm_unlink(_name);
+	}
+
+	// the record keeps counting when it is reused
+	thread_stats* getStats(int index, int tid) {
+		thread_stats* stats = &_stats[index];
+		stats->tid = tid;
+		stats->active = 1;
+		return stats;
+	}
+
+private:
+	char _name[64];
+	size_t _size;
+	live_stats_header* _header;
+	thread_stats* _stats;
+};
+#endif
@@ -0,0 +1,103 @@
+/* Copyright (C)
+* 2017 - Jinpeng Zhou, Jinpeng.Zhou@utsa.edu
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU General Public License
+* as published by the Free Software Foundation; either version 2
+* of the License, or (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; if not, write to the Free Software
+* Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*
+*/
+/**
+* @file lockclass.hh
+* @brief Map locks to classes, keyed by their init or 1st acquisition call sites.
+* @author Jinpeng Zhou, Jinpeng.Zhou@utsa.edu
+*/
+#ifndef __LOCKCLASS_HH__
+#define __LOCKCLASS_HH__
+
+#include "xdefines.hh"
+
+/*
+ * A class is represented by the 1st lock seen with its call site, so that
+ * dependencies, detection and history keep working on real lock addresses.
+ * Both tables are open addressing with CAS, entries are never removed.
+ */
+class lockclass {
+private:
+	lockclass() { }
+
+	struct entry {
+		void* key;
+		void* lockClass;
+	};
+
+public:
+	static lockclass& getInstance() {
+		static char buf[sizeof(lockclass)];
+		static lockclass* theOneTrueObject = new (buf) lockclass();
+		return *theOneTrueObject;
+	}
+
+	void initialize() {
+		_classes = (entry*)MM::mmapAllocatePrivate(xdefines::LOCK_CLASS_MAX * sizeof(entry));
+		_locks = (entry*)MM::mmapAllocatePrivate(xdefines::LOCK_CLASS_MAP_SIZE * sizeof(entry));
+	}
+
+	// a lock is (re-)initialized at the call site
+	void setClass(void* lock, void* site) {
+		if(_locks == NULL) return;
+		entry* e = findEntry(_locks, xdefines::LOCK_CLASS_MAP_SIZE, lock);
+		if(e == NULL) return;
+		void* lockClass = getSiteClass(site, lock);
+		__atomic_store_n(&e->lockClass, lockClass, __ATOMIC_RELEASE);
+	}
+
+	// the class of a lock, one never initialized takes the class of the acquisition site.
+	// The lock itself if the tables are full.
+	INLINE void* getClass(void* lock, void* site) {
+		if(_locks == NULL) return lock;
+		entry* e = findEntry(_locks, xdefines::LOCK_CLASS_MAP_SIZE, lock);
+		if(e == NULL) return lock;
+		void* lockClass = __atomic_load_n(&e->lockClass, __ATOMIC_ACQUIRE);
+		if(lockClass != NULL) return lockClass;
+		lockClass = getSiteClass(site, lock);
+		void* expected = NULL;
+		if(!__atomic_compare_exchange_n(&e->lockClass, &expected, lockClass, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) return expected;
+		return lockClass;
+	}
+
+private:
+	void* getSiteClass(void* site, void* lock) {
+		entry* e = findEntry(_classes, xdefines::LOCK_CLASS_MAX, site);
+		if(e == NULL) return lock;
+		void* expected = NULL;
+		if(__atomic_compare_exchange_n(&e->lockClass, &expected, lock, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) return lock;
+		return expected;
+	}
+
+	// find or claim the entry of the key, NULL when too far from its home
+	INLINE entry* findEntry(entry* table, size_t size, void* key) {
+		size_t mask = size - 1;
+		size_t index = callsite_tree::hashCaller(key) & mask;
+		for(int probe = 0; probe < xdefines::LOCK_CLASS_PROBE_MAX; probe++, index = (index + 1) & mask) {
+			entry* e = &table[index];
+			void* current = __atomic_load_n(&e->key, __ATOMIC_ACQUIRE);
+			if(current == key) return e;
+			if(current != NULL) continue;
+			if(__atomic_compare_exchange_n(&e->key, &current, key, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) || current == key) return e;
+		}
+		return NULL;
+	}
+
+	entry* _classes; // call site -> class
+	entry* _locks; // lock -> class
+};
+#endif
@@ -0,0 +1,221 @@
+/* Copyright (C)
+* 2017 - Jinpeng Zhou, Jinpeng.Zhou@utsa.edu
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU General Public License
+* as published by the Free Software Foundation; either version 2
+* of the License, or (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; if not, write to the Free Software
+* Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*
+*/
+/**
+* @file lockgraph.hh
+* @brief Online cycle detection on the global lock-order graph.
+* @author Jinpeng Zhou, Jinpeng.Zhou@utsa.edu
+*/
+#ifndef __LOCKGRAPH_HH__
+#define __LOCKGRAPH_HH__
+
+#include "xdefines.hh"
+
+#include <map>
+#include <algorithm>
+
+using namespace std;
+
+/*
+ * Every held lock -> acquired lock of a brand-new dependency is an edge.
+ * The graph is kept acyclic under a dynamic topological order (Pearce-Kelly),
+ * so an edge that agrees with the order costs nothing, and only the nodes
+ * between its two ends are visited otherwise.
+ * An edge closing a cycle is a potential deadlock, it is reported and kept out of the graph.
+ * Like the lock-order graph itself, it doesn't know about gate locks, the analysis at exit does.
+ */
+class lockgraph {
+private:
+	lockgraph() { }
+
+public:
+	static lockgraph& getInstance() {
+		static char buf[sizeof(lockgraph)];
+		static lockgraph* theOneTrueObject = new (buf) lockgraph();
+		return *theOneTrueObject;
+	}
+
+	void initialize() {
+		WRAP(pthread_mutex_init)(&_lock, NULL);
+		_nodeMap.initialize(HashFuncs::hashAddr, HashFuncs::compareAddr, xdefines::MAX_SYNC_ITEMS);
+		_epoch = 0;
+		_cycleAmount = 0;
+	}
+
+	// called for a brand-new dependency only
+	void addDependency(int thread, void* lock, void** holdingSet, int holdingCount) {
+		WRAP(pthread_mutex_lock)(&_lock);
+		int y = getNode(lock);
+		for(int i = 0; i < holdingCount; i++) {
+			if(holdingSet[i] == lock) continue;
+			insertEdge(getNode(holdingSet[i]), y, thread);
+		}
+		WRAP(pthread_mutex_unlock)(&_lock);
+	}
+
+	int getCycleAmount() { return _cycleAmount; }
+
+	// held across a fork, so the child doesn't inherit it locked by a thread it doesn't have
+	void lock() { WRAP(pthread_mutex_lock)(&_lock); }
+
+	void unlock() { WRAP(pthread_mutex_unlock)(&_lock); }
+
+private:
+	struct edge {
+		edge(int n = 0, int t = 0) : node(n), thread(t) {}
+		int node;
+		int thread; // the thread recording it, -1 if more than one
+	};
+
+	int getNode(void* lock) {
+		int id;
+		if(_nodeMap.find(lock, sizeof(void*), &id)) return id;
+		id = _lockOf.size();
+		_nodeMap.insert(lock, sizeof(void*), id);
+		_lockOf.push_back(lock);
+		_ord.push_back(id); // a new node goes last in the order
+		_out.push_back(vector<edge>());
+		_in.push_back(vector<int>());
+		_mark.push_back(0);
+		_parent.push_back(-1);
+		return id;
+	}
+
+	edge* findEdge(int x, int y) {
+		for(size_t i = 0; i < _out[x].size(); i++) {
+			if(_out[x][i].node == y) return &_out[x][i];
+		}
+		return NULL;
+	}
+
+	void insertEdge(int x, int y, int thread) {
+		edge* e = findEdge(x, y);
+		if(e != NULL) {
+			if(e->thread != thread) e->thread = -1;
+			return;
+		}
+		map<pair<int, int>, int>::iterator rejected = _rejected.find(make_pair(x, y));
+		if(rejected != _rejected.end() && (rejected->second == thread || rejected->second < 0)) return;
+		if(_ord[x] > _ord[y]) {
+			// y is before x, search the affected region [ord[y], ord[x]]
+			vector<int> forward;
+			vector<int> backward;
+			if(!searchForward(y, x, forward)) {
+				reportCycle(x, y, thread);
+				return;
+			}
+			searchBackward(x, _ord[y], backward);
+			reorder(forward, backward);
+		}
+		_out[x].push_back(edge(y, thread));
+		_in[y].push_back(x);
+	}
+
+	// nodes reachable from start within ord <= ord[target], false if target is reached
+	bool searchForward(int start, int target, vector<int>& visited) {
+		int ub = _ord[target];
+		_epoch++;
+		vector<int> stack(1, start);
+		_mark[start] = _epoch;
+		_parent[start] = -1;
+		while(!stack.empty()) {
+			int n = stack.back();
+			stack.pop_back();
+			visited.push_back(n);
+			for(size_t i = 0; i < _out[n].size(); i++) {
+				int w = _out[n][i].node;
+				if(w == target) {
+					_parent[w] = n;
+					return false;
+				}
+				if(_mark[w] == _epoch || _ord[w] > ub) continue;
+				_mark[w] = _epoch;
+				_parent[w] = n;
+				stack.push_back(w);
+			}
+		}
+		return true;
+	}
+
+	// nodes reaching start within ord >= lb
+	void searchBackward(int start, int lb, vector<int>& visited) {
+		_epoch++;
+		vector<int> stack(1, start);
+		_mark[start] = _epoch;
+		while(!stack.empty()) {
+			int n = stack.back();
+			stack.pop_back();
+			visited.push_back(n);
+			for(size_t i = 0; i < _in[n].size(); i++) {
+				int w = _in[n][i];
+				if(_mark[w] == _epoch || _ord[w] < lb) continue;
+				_mark[w] = _epoch;
+				stack.push_back(w);
+			}
+		}
+	}
+
+	// the nodes reaching x go before the ones reachable from y, reusing their positions
+	void reorder(vector<int>& forward, vector<int>& backward) {
+		sort(forward.begin(), forward.end(), compareOrd(_ord));
+		sort(backward.begin(), backward.end(), compareOrd(_ord));
+		vector<int> positions;
+		for(size_t i = 0; i < backward.size(); i++) positions.push_back(_ord[backward[i]]);
+		for(size_t i = 0; i < forward.size(); i++) positions.push_back(_ord[forward[i]]);
+		sort(positions.begin(), positions.end());
+		size_t p = 0;
+		for(size_t i = 0; i < backward.size(); i++) _ord[backward[i]] = positions[p++];
+		for(size_t i = 0; i < forward.size(); i++) _ord[forward[i]] = positions[p++];
+	}
+
+	struct compareOrd {
+		compareOrd(vector<int>& ord) : _ord(ord) {}
+		bool operator()(int a, int b) const { return _ord[a] < _ord[b]; }
+		vector<int>& _ord;
+	};
+
+	// x -> y closes the path y -> ... -> x found by searchForward()
+	void reportCycle(int x, int y, int thread) {
+		vector<int> path;
+		bool single = true; // all recorded by this thread, not a deadlock
+		for(int n = x; n != y; n = _parent[n]) {
+			path.push_back(n);
+			if(findEdge(_parent[n], n)->thread != thread) single = false;
+		}
+		path.push_back(y);
+		_rejected[make_pair(x, y)] = single ? thread : -1;
+		if(single) return;
+		_cycleAmount++;
+		fprintf(stderr, "Potential deadlock found online: ");
+		for(int i = path.size() - 1; i >= 0; i--) fprintf(stderr, "%p -> ", _lockOf[path[i]]);
+		fprintf(stderr, "%p\n", _lockOf[y]);
+	}
+
+	pthread_mutex_t _lock;
+	typedef HashMap<void*, int, HeapAllocator> NodeHashMap;
+	NodeHashMap _nodeMap; // lock -> node
+	vector<void*> _lockOf; // node -> lock
+	vector<int> _ord; // topological position of every node
+	vector<vector<edge> > _out;
+	vector<vector<int> > _in;
+	vector<int> _mark; // visited in the search of _epoch
+	vector<int> _parent; // for the path of a cycle
+	int _epoch;
+	map<pair<int, int>, int> _rejected; // edges closing a cycle, by the thread recording them, -1 if reported
+	int _cycleAmount;
+};
+#endif
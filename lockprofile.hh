@@ -0,0 +1,235 @@
+/* Copyright (C)
+* 2017 - Jinpeng Zhou, Jinpeng.Zhou@utsa.edu
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU General Public License
+* as published by the Free Software Foundation; either version 2
+* of the License, or (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; if not, write to the Free Software
+* Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*
+*/
+/**
+* @file lockprofile.hh
+* @brief Wait and hold time histograms per lock and per acquisition call site.
+* @author Jinpeng Zhou, Jinpeng.Zhou@utsa.edu
+*/
+#ifndef __LOCKPROFILE_HH__
+#define __LOCKPROFILE_HH__
+
+#include "xdefines.hh"
+
+#include <algorithm>
+
+using namespace std;
+
+// an acquisition call site of a lock
+struct site_profile {
+	void* site;
+	size_t acquisitions;
+	uint64_t waitTicks;
+	uint64_t holdTicks;
+};
+
+// only the thread holding the lock writes it, waiters only read the holder
+struct lock_profile {
+	void* lock;
+	int holder; // thread index + 1, 0 if not held
+	int depth; // recursive acquisitions by the holder
+	uint64_t since; // ticks when acquired
+	site_profile* holdingSite;
+	size_t acquisitions;
+	size_t contended; // found held by another thread
+	uint64_t waitTicks;
+	uint64_t holdTicks;
+	size_t waitHist[xdefines::LOCK_PROFILE_BUCKETS]; // bucket i counts [2^i, 2^(i+1)) ticks
+	size_t holdHist[xdefines::LOCK_PROFILE_BUCKETS];
+	site_profile sites[xdefines::LOCK_PROFILE_SITE_MAX];
+};
+
+// an acquisition on its way, kept on the stack of the acquiring thread
+struct lock_wait {
+	lock_profile* profile;
+	uint64_t start;
+	bool contended;
+};
+
+/*
+ * Locks are found in an open addressing table claimed with CAS, entries are never removed.
+ * Wait time is from the interposed call to the acquisition, so it includes the bookkeeping.
+ * Hold time of a lock released by pthread_cond_wait() stops there, and restarts when it returns.
+ */
+class lockprofile {
+private:
+	lockprofile() { }
+
+public:
+	static lockprofile& getInstance() {
+		static char buf[sizeof(lockprofile)];
+		static lockprofile* theOneTrueObject = new (buf) lockprofile();
+		return *theOneTrueObject;
+	}
+
+	void initialize() {
+		_profiles = (lock_profile*)MM::mmapAllocatePrivate(xdefines::LOCK_PROFILE_MAP_SIZE * sizeof(lock_profile));
+		_dropped = 0;
+		_startTicks = getTicks();
+		_startNanos = getNanos();
+	}
+
+	INLINE lock_wait waiting(void* lock, int thread) {
+		lock_wait wait;
+		wait.profile = findProfile(lock);
+		if(wait.profile == NULL) __atomic_add_fetch(&_dropped, 1, __ATOMIC_RELAXED);
+		int holder = wait.profile == NULL ? 0 : __atomic_load_n(&wait.profile->holder, __ATOMIC_RELAXED);
+		wait.contended = holder != 0 && holder != thread + 1;
+		wait.start = getTicks();
+		return wait;
+	}
+
+	INLINE void acquired(lock_wait* wait, int thread, void* site) {
+		lock_profile* p = wait->profile;
+		if(p == NULL) return;
+		if(p->depth++ > 0) return;
+		uint64_t now = getTicks();
+		uint64_t ticks = now - wait->start;
+		__atomic_store_n(&p->holder, thread + 1, __ATOMIC_RELAXED);
+		p->since = now;
+		p->acquisitions++;
+		if(wait->contended) p->contended++;
+		p->waitTicks += ticks;
+		p->waitHist[getBucket(ticks)]++;
+		p->holdingSite = findSite(p, site);
+		if(p->holdingSite != NULL) {
+			p->holdingSite->acquisitions++;
+			p->holdingSite->waitTicks += ticks;
+		}
+	}
+
+	// before the lock is released, by its holder only
+	INLINE void releasing(void* lock, int thread) {
+		lock_profile* p = findProfile(lock);
+		if(p == NULL || p->holder != thread + 1 || --p->depth > 0) return;
+		uint64_t ticks = getTicks() - p->since;
+		p->holdTicks += ticks;
+		p->holdHist[getBucket(ticks)]++;
+		if(p->holdingSite != NULL) p->holdingSite->holdTicks += ticks;
+		__atomic_store_n(&p->holder, 0, __ATOMIC_RELAXED);
+	}
+
+	// pthread_cond_wait() releases the lock with all recursive acquisitions, return them
+	INLINE int suspend(void* lock, int thread) {
+		lock_profile* p = findProfile(lock);
+		if(p == NULL || p->holder != thread + 1) return 0;
+		int depth = p->depth;
+		p->depth = 1;
+		site_profile* site = p->holdingSite;
+		releasing(lock, thread);
+		p->holdingSite = site;
+		return depth;
+	}
+
+	// the lock is held again when pthread_cond_wait() returns, no wait is counted
+	INLINE void resume(void* lock, int thread, int depth) {
+		lock_profile* p = findProfile(lock);
+		if(p == NULL || depth == 0) return;
+		__atomic_store_n(&p->holder, thread + 1, __ATOMIC_RELAXED);
+		p->depth = depth;
+		p->since = getTicks();
+	}
+
+	// rank locks by hold time and by wait time
+	void report() {
+		double ticksPerNano = (double)(getTicks() - _startTicks) / (getNanos() - _startNanos);
+		vector<lock_profile*> profiles;
+		for(size_t i = 0; i < xdefines::LOCK_PROFILE_MAP_SIZE; i++) {
+			if(_profiles[i].acquisitions > 0) profiles.push_back(&_profiles[i]);
+		}
+		fprintf(stderr, "Lock profile: %zu locks, %.2f ticks per ns", profiles.size(), ticksPerNano);
+		if(_dropped > 0) fprintf(stderr, ", %zu acquisitions on locks not fitting in the table", _dropped);
+		fprintf(stderr, "\n");
+		if(profiles.empty()) return;
+		sort(profiles.begin(), profiles.end(), compareHold);
+		fprintf(stderr, "Hottest locks, by hold time:\n");
+		for(size_t i = 0; i < profiles.size() && i < xdefines::LOCK_PROFILE_TOP; i++) reportLock(profiles[i], ticksPerNano, true);
+		sort(profiles.begin(), profiles.end(), compareWait);
+		fprintf(stderr, "Most contended locks, by wait time:\n");
+		for(size_t i = 0; i < profiles.size() && i < xdefines::LOCK_PROFILE_TOP; i++) {
+			if(profiles[i]->contended == 0) break;
+			reportLock(profiles[i], ticksPerNano, false);
+		}
+	}
+
+private:
+	static bool compareHold(lock_profile* a, lock_profile* b) { return a->holdTicks > b->holdTicks; }
+	static bool compareWait(lock_profile* a, lock_profile* b) { return a->waitTicks > b->waitTicks; }
+
+	void reportLock(lock_profile* p, double ticksPerNano, bool hold) {
+		fprintf(stderr, "  %p: %zu acquisitions, %zu contended, wait %.3f ms, hold %.3f ms\n",
+				p->lock, p->acquisitions, p->contended, p->waitTicks / ticksPerNano / 1e6, p->holdTicks / ticksPerNano / 1e6);
+		reportHistogram(hold ? "hold" : "wait", hold ? p->holdHist : p->waitHist, ticksPerNano);
+		for(int s = 0; s < xdefines::LOCK_PROFILE_SITE_MAX && p->sites[s].site != NULL; s++) {
+			site_profile* sp = &p->sites[s];
+			fprintf(stderr, "    site %p: %zu acquisitions, wait %.3f ms, hold %.3f ms\n",
+					sp->site, sp->acquisitions, sp->waitTicks / ticksPerNano / 1e6, sp->holdTicks / ticksPerNano / 1e6);
+		}
+	}
+
+	// non-empty buckets, by their lower bound
+	void reportHistogram(const char* name, size_t* hist, double ticksPerNano) {
+		fprintf(stderr, "    %s:", name);
+		for(int b = 0; b < xdefines::LOCK_PROFILE_BUCKETS; b++) {
+			if(hist[b] == 0) continue;
+			double nanos = (double)(1UL << b) / ticksPerNano;
+			if(nanos < 1000) fprintf(stderr, " %.0fns:%zu", nanos, hist[b]);
+			else if(nanos < 1000000) fprintf(stderr, " %.0fus:%zu", nanos / 1e3, hist[b]);
+			else fprintf(stderr, " %.0fms:%zu", nanos / 1e6, hist[b]);
+		}
+		fprintf(stderr, "\n");
+	}
+
+	static INLINE int getBucket(uint64_t ticks) {
+		int bucket = 63 - __builtin_clzl(ticks | 1);
+		return bucket < xdefines::LOCK_PROFILE_BUCKETS ? bucket : xdefines::LOCK_PROFILE_BUCKETS - 1;
+	}
+
+	// written by the holder only, NULL when all are taken
+	INLINE site_profile* findSite(lock_profile* p, void* site) {
+		for(int s = 0; s < xdefines::LOCK_PROFILE_SITE_MAX; s++) {
+			if(p->sites[s].site == site) return &p->sites[s];
+			if(p->sites[s].site == NULL) {
+				p->sites[s].site = site;
+				return &p->sites[s];
+			}
+		}
+		return NULL;
+	}
+
+	// find or claim the profile of the lock, NULL when too far from its home
+	INLINE lock_profile* findProfile(void* lock) {
+		if(_profiles == NULL) return NULL;
+		size_t mask = xdefines::LOCK_PROFILE_MAP_SIZE - 1;
+		size_t index = callsite_tree::hashCaller(lock) & mask;
+		for(int probe = 0; probe < xdefines::LOCK_PROFILE_PROBE_MAX; probe++, index = (index + 1) & mask) {
+			lock_profile* p = &_profiles[index];
+			void* current = __atomic_load_n(&p->lock, __ATOMIC_ACQUIRE);
+			if(current == lock) return p;
+			if(current != NULL) continue;
+			if(__atomic_compare_exchange_n(&p->lock, &current, lock, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) || current == lock) return p;
+		}
+		return NULL;
+	}
+
+	lock_profile* _profiles;
+	size_t _dropped;
+	// to turn ticks into time
+	uint64_t _startTicks;
+	uint64_t _startNanos;
+};
+#endif
@@ -25,6 +25,11 @@
 #define __PREVENTION_HH__
 
 #include "xdefines.hh"
+#include "history.hh"
+
+#include <algorithm>
+#include <string>
+#include <sys/stat.h>
 
 using namespace std;
 
@@ -33,6 +38,9 @@ extern int mutexUnit;
 extern void* mainTop;
 extern void* textTop;
 extern char *__progname_full;
+extern my_mutex* realMutexStart;
+extern size_t realMutexIndex;
+extern bool isSingleThread;
 
 class prevention {
 private:
@@ -48,158 +56,305 @@ public:
 	// read deadlock history file, and determine whether we need to enable prevention
 	bool loadDeadlockInfo() {
 		specialTail = specialList = new special_info_list;
-		_callsiteTree = NULL;
-		string deadlockFilename = string(__progname_full) + DEADLOCK_FILE;
-		_deadlockFile.open(deadlockFilename.c_str());
-		if(!_deadlockFile.is_open()) {
-			//fprintf(stderr, "No deadlock data in %s\n", deadlockFilename.c_str());
-			return false;
+		_index = NULL;
+		_specialSlotAmount = 0;
+		_historyFilename = string(__progname_full) + DEADLOCK_FILE;
+		// cycles a crashed run found during execution
+		string journalFilename = string(__progname_full) + DEADLOCK_JOURNAL;
+		history::foldJournal(journalFilename.c_str(), _historyFilename.c_str());
+		_historyMtime = getHistoryMtime();
+		special_info_list* sets = parseHistory();
+		int setAmount = 0;
+		int slotAmount = 0;
+		for(special_info_list* sll = sets->next; sll != NULL; sll = sll->next) {
+			setAmount++;
+			slotAmount += sll->count;
 		}
-		if(_deadlockFile.eof()) {
-			_deadlockFile.close();
-			return false;
+		allocateSlots(setAmount, slotAmount);
+		applyHistory(sets);
+		if(_mergesetAmount == 0) return false;
+		return true;
+	}
+
+	// parse the merge sets in the history file, without touching what's already applied
+	special_info_list* parseHistory() {
+		special_info_list* sets = new special_info_list;
+		special_info_list* tail = sets;
+		ifstream deadlockFile(_historyFilename.c_str());
+		if(!deadlockFile.is_open()) {
+			//fprintf(stderr, "No deadlock data in %s\n", _historyFilename.c_str());
+			return sets;
 		}
 		// there's a hitory
-		uintptr_t realMutex;
-		_callsiteTree = new callsite_tree();
-		while(!_deadlockFile.eof()) {
+		while(!deadlockFile.eof()) {
 			// start read
-			callsite_tree* currentNode = _callsiteTree;
 			char buf;
-			buf = _deadlockFile.get();
+			buf = deadlockFile.get();
 			if(buf == '-') {
 				// new deadlock
-				specialTail->next = new special_info_list;
-				specialTail = specialTail->next;
-				// assign a new special/shared lock to this new deadlock
-				realMutex = (uintptr_t)ADDITIONAL_LOCK_STARTADDR + _mutexUnit * _mergesetAmount++;
+				tail->next = new special_info_list;
+				tail = tail->next;
 				// skip the '\n'
-				_deadlockFile.get();
+				deadlockFile.get();
 			} else if (buf == ' ') {
 				// reading detailed lock info in the same deadlock
 				uintptr_t callerAddr = 0;
 				uintptr_t lockAddr = 0;
 				callstack* stackList = new callstack(); // record the callstacks for the lock object 
-				currentNode = _callsiteTree; // current position when searching insert point in the tree
-				_deadlockFile>>lockAddr; // read lock address
+				deadlockFile>>lockAddr; // read lock address
 				while(1) { // read call stacks for this lock object
-					buf = _deadlockFile.get();
+					buf = deadlockFile.get();
 					if(buf == '.') { // end of call stacks
-						_deadlockFile.get();
+						deadlockFile.get();
 						break;
 					}
-					_deadlockFile>>callerAddr; // read one caller address
+					deadlockFile>>callerAddr; // read one caller address
 					stackList->stack[stackList->found++] = (void*)callerAddr;
-					// insert into tree
-					callsite_tree *newNode = new callsite_tree((void*)callerAddr);
-					// seach insert point
-					if(currentNode->child == NULL) {
-						currentNode->child = newNode;
-					} else { // current node has some children. check them
-						callsite_tree *t = currentNode->child;
-						callsite_tree *tPrev = t;
-						while(t != NULL) { // check every child
-							if(t->callerAddr == (void*)callerAddr) {
-								// this addr is in one child of current
-								break;
-							}
-							tPrev = t;
-							t = t->siblings;
-						}
-						if(t == NULL) { // this addr is a not a child of current
-							tPrev->siblings = newNode;
-						} else {
-							currentNode = t;
-							continue;
-						}
-					}
-					currentNode = newNode;
 				}
 				// here we should notice that: one lock only appears once in the history file
-				// record this lock object and its callstacks
-				special_info* newinfo = new special_info((void*)lockAddr, stackList);
-				specialTail->insertToTail(newinfo);
-
-				if(callerAddr == 0) {
-					// this lock has no call site, which means this lock is initilized by MACRO
-					// this lockAddr must be a global mutex that already exists in memory
-					// do in-direction here
-					*(uintptr_t*)lockAddr = realMutex;
-				} else if(currentNode->child == NULL){
-					// this lock is initialzied by init()
-					// the corresponding callstacks has not been recorded before
-					// Add the shared lock as a leaf for this 'path'
-					callsite_tree *newLeaf = new callsite_tree((void*)realMutex);
-					currentNode->child = newLeaf;
-				}
+				// record this lock object and its callstacks, its member slot is assigned when applied
+				tail->insertToTail(new special_info((void*)lockAddr, stackList));
+				tail->count++;
+			} else if (buf == '@') {
+				// acquisition call site of the last lock
+				uintptr_t addr_1 = 0;
+				uintptr_t addr_2 = 0;
+				deadlockFile>>addr_1>>addr_2;
+				deadlockFile.get(); // skip the '\n'
+				if(tail->isEmpty()) continue;
+				special_info* si = tail->tail->entry;
+				acq_callsite** last = &si->acqsite;
+				while(*last != NULL) last = &(*last)->next;
+				*last = new acq_callsite((void*)addr_1, (void*)addr_2);
+			} else if (buf == '>') {
+				// acquisition order inside the set, by member indexes
+				int held = 0;
+				int acquired = 0;
+				deadlockFile>>held>>acquired;
+				deadlockFile.get(); // skip the '\n'
+				if(held < 0 || acquired < 0) continue;
+				tail->edges.push_back(make_pair(held, acquired));
+			} else if (buf == '^') {
+				// call site of an acquisition that forms the cycles
+				uintptr_t site = 0;
+				deadlockFile>>site;
+				deadlockFile.get(); // skip the '\n'
+				tail->gateSites.push_back((void*)site);
 			}
 		}
-		_deadlockFile.close();
-		if(_mergesetAmount == 0) return false;
-		return true;
+		deadlockFile.close();
+		return sets;
+	}
+
+	// per merge set and per member slot arrays, they are never reallocated,
+	// so that a reload doesn't race with the threads reading them
+	void allocateSlots(int setAmount, int slotAmount) {
+#ifdef HOT_RELOAD
+		if(setAmount < xdefines::RELOAD_SET_CAPACITY) setAmount = xdefines::RELOAD_SET_CAPACITY;
+		if(slotAmount < xdefines::RELOAD_SLOT_CAPACITY) slotAmount = xdefines::RELOAD_SLOT_CAPACITY;
+#endif
+		_setCapacity = setAmount;
+		_slotCapacity = slotAmount;
+		_historySets.reserve(setAmount);
+		_setBase.reserve(setAmount);
+		_orderSlots = new order_slot[slotAmount];
+		_rankSlot = new int[slotAmount];
+		_avoidHeld = new int[slotAmount]();
+		_avoidLocks = new char[setAmount]();
+		_specialStats = new special_stats[setAmount]();
+	}
+
+	// assign the shared locks and member slots to parsed merge sets, and publish them.
+	// Sets that are already applied are skipped.
+	void applyHistory(special_info_list* sets) {
+		int setAmount = _mergesetAmount;
+		int slotAmount = _specialSlotAmount;
+		special_info_list* next = NULL;
+		for(special_info_list* sll = sets->next; sll != NULL; sll = next) {
+			next = sll->next;
+			sll->next = NULL;
+#ifdef HOT_RELOAD
+			if(!_appliedSets.insert(getSetKey(sll)).second) continue;
+#endif
+			if(setAmount >= _setCapacity || slotAmount + sll->count > _slotCapacity) {
+				fprintf(stderr, "Too many merge sets in %s, the rest are ignored\n", _historyFilename.c_str());
+				break;
+			}
+			_historySets.push_back(sll);
+			_setBase.push_back(slotAmount);
+			for(auto si = sll->list->next; si != NULL; si = si->next) {
+				si->entry->specialSlot = slotAmount;
+				_orderSlots[slotAmount++].set = setAmount;
+			}
+			classifySet(setAmount++);
+			specialTail->next = sll;
+			specialTail = sll;
+		}
+		if(setAmount == _mergesetAmount) return;
+		int firstSet = _mergesetAmount;
+		// allocation for additional locks
+		growSpecialLocks(setAmount);
+		history_index* index = buildIndex();
+		// the new slots are ready before anything is redirected to them
+		__atomic_store_n(&_specialSlotAmount, slotAmount, __ATOMIC_RELEASE);
+		__atomic_store_n(&_mergesetAmount, setAmount, __ATOMIC_RELEASE);
+		__atomic_store_n(&_index, index, __ATOMIC_RELEASE);
+		// the new sets may have recorded them
+		memset(_acqMisses, 0, sizeof(_acqMisses));
+		if(!_offline) redirectGlobals(firstSet);
 	}
 
 	/// @brief Initialize the system.
-	void initialize()	{
+	/// offline is for tools/undead-analyze, the locks in the history are not in that process.
+	void initialize(bool offline = false)	{
+		_offline = offline;
 		_mergesetAmount = 0;
+		_orderedAmount = 0;
+		_reboundAmount = 0;
 		_mutexUnit = mutexUnit;
 		_additionalLockAddr = ADDITIONAL_LOCK_STARTADDR;
-		_additionalLockAddrEnd = 0;
+		_additionalLockAddrEnd = ADDITIONAL_LOCK_STARTADDR;
 		// read deadlock history file and check whether enable prevention
 		enablePrevention = loadDeadlockInfo();
-		if(enablePrevention) {
-			// allocation for additional locks
-			_additionalLockAddr = (uintptr_t)MM::mmapAllocatePrivate(_mergesetAmount * _mutexUnit, false, (void*)ADDITIONAL_LOCK_STARTADDR);
-			if(_additionalLockAddr == 0) {
-				fprintf(stderr, "Failed to allocate for the additional locks from %p\n", (void*)ADDITIONAL_LOCK_STARTADDR);
-				abort();
-			} else {
-				_additionalLockAddrEnd = _additionalLockAddr + _mergesetAmount * _mutexUnit;
-				pthread_mutexattr_t attr;
-				pthread_mutexattr_init(&attr);
-				for(int index = 0; index < _mergesetAmount; index++) {
-					pthread_mutex_t* mutex = (pthread_mutex_t*)(_additionalLockAddr + index * _mutexUnit);
-					int ret = WRAP(pthread_mutex_init)(mutex, &attr);
-					if(ret != 0) {
-						fprintf(stderr, "Failed to initalize additional locks\n");
-					}
-				}
-			}
-		}
 	}
 
-	// find the addr in the tree
-	callsite_tree* locateInCallsiteTree(callsite_tree* root, void* addr) {
-		if(root->child == NULL) return NULL;
-		for(callsite_tree *t = root->child; t != NULL; t = t->siblings) {
-			if(t->callerAddr == addr) return t;
-		}
-		return NULL;
+#ifdef HOT_RELOAD
+	// called by the monitor thread, apply the merge sets newly written into the history file.
+	// Locks initialized or first acquired before keep their redirection.
+	void checkReload() {
+		struct timespec mtime = getHistoryMtime();
+		if(mtime.tv_sec == _historyMtime.tv_sec && mtime.tv_nsec == _historyMtime.tv_nsec) return;
+		_historyMtime = mtime;
+		int before = _mergesetAmount;
+		applyHistory(parseHistory());
+		if(_mergesetAmount == before) return;
+		fprintf(stderr, "Reloaded %d merge sets from %s\n", _mergesetAmount - before, _historyFilename.c_str());
+		enablePrevention = true;
 	}
+#endif
 
 	INLINE int mutex_init(pthread_mutex_t* mutex, pthread_mutex_t* real_mutex, const pthread_mutexattr_t* attr, thread_t* thread, void** addr, int len, uintptr_t* redirect) {
-		callsite_tree *currentNode = _callsiteTree;
+		history_index* index = __atomic_load_n(&_index, __ATOMIC_ACQUIRE);
+		callsite_tree *currentNode = index->tree;
 		for(int i = 0; i < len; i++) {
 			if(addr[i + 1] == mainTop || i >= xdefines::MAX_STACK_DEPTH) break;
 			if(addr[i] > textTop) continue;
+			// unrelated init sites exit here
+			if(currentNode == index->tree && !index->filter.mayContain(addr[i])) {
+				currentNode = NULL;
+				break;
+			}
 			// find the caller-address's position in the tree
-			currentNode = locateInCallsiteTree(currentNode, addr[i]);
+			currentNode = currentNode->findChild(addr[i]);
 			if(currentNode == NULL) {
 				// no need to continue match
 				break;
 			}		
 		}
-		if(currentNode == NULL || currentNode == _callsiteTree) {
-			// cannot find a corresponding node, this is a nomarl lock
+		if(currentNode == NULL || currentNode->realMutex == NULL) {
+			// cannot find a recorded call stack, this is a nomarl lock
+			((my_mutex*)real_mutex)->specialSlot = -1;
+			return WRAP(pthread_mutex_init)(real_mutex, attr);
+		} else if(keepsMutex(currentNode->specialSlot)) {
+			// a member of an ordered or gated set keeps its own mutex
+			((my_mutex*)real_mutex)->specialSlot = currentNode->specialSlot;
+			bindMember(currentNode->specialSlot, mutex);
 			return WRAP(pthread_mutex_init)(real_mutex, attr);
 		} else {
-			// now currentNode's child should be a leaf in the callsite tree, we can do in-direction
-			assert(currentNode->child != NULL); // should have a leaf
-			*redirect = *(uintptr_t*)real_mutex = (uintptr_t)currentNode->child->callerAddr; // since it's a leaf now, the callerAddr represents the real mutex
+			// now a recorded call stack ends at currentNode, we can do in-direction
+			*redirect = *(uintptr_t*)real_mutex = (uintptr_t)currentNode->realMutex;
+			((my_mutex*)real_mutex)->specialSlot = currentNode->specialSlot;
+			countMapped(currentNode->realMutex);
 			return 0;
 		}
 	}
 
+	void addAcqCallsite(history_index* index, acq_callsite* site) {
+		void* key = acq_callsite::getKey(site->addr[0], site->addr[1]);
+		acq_callsite* head = NULL;
+		if(index->acqMap.find(key, sizeof(void*), &head)) {
+			for(acq_callsite* t = head; t != NULL; t = t->hashNext) {
+				// one call site can only be redirected to one shared lock
+				if(t->addr[0] == site->addr[0] && t->addr[1] == site->addr[1]) return;
+			}
+			index->acqMap.erase(key, sizeof(void*));
+		}
+		site->hashNext = head;
+		index->acqMap.insert(key, sizeof(void*), site);
+		index->acqAmount++;
+	}
+
+	// find the shared lock for an acquisition call site
+	acq_callsite* locateAcqCallsite(history_index* index, void* addr_1, void* addr_2) {
+		acq_callsite* head;
+		if(!index->acqMap.find(acq_callsite::getKey(addr_1, addr_2), sizeof(void*), &head)) return NULL;
+		for(acq_callsite* t = head; t != NULL; t = t->hashNext) {
+			if(t->addr[0] == addr_1 && t->addr[1] == addr_2) return t;
+		}
+		return NULL;
+	}
+
+	// a real mutex from the pool, the one given back by this thread first
+	my_mutex* takeRealMutex(thread_t* thread) {
+		my_mutex* myMutex = thread->spareMutex;
+		if(myMutex != NULL) {
+			thread->spareMutex = NULL;
+			return myMutex;
+		}
+		size_t mutexIndex = __atomic_fetch_add(&realMutexIndex, 1, __ATOMIC_RELAXED);
+		if(mutexIndex < xdefines::MAX_SYNC_OBJ) return realMutexStart + mutexIndex;
+		if(!__atomic_exchange_n(&_poolWarned, true, __ATOMIC_RELAXED)) {
+			fprintf(stderr, "All %lu real mutexes are in use, new mutexes are not prevented\n", (unsigned long)xdefines::MAX_SYNC_OBJ);
+		}
+		return NULL;
+	}
+
+	// first acquisition of a mutex that was never initialized by init(),
+	// e.g. zero-initialized, memset, or PTHREAD_MUTEX_INITIALIZER.
+	// Attach a real mutex to it, and decide the redirection by the acquisition call site.
+	// The attached real mutex caches the decision, later acquisitions don't come here.
+	INLINE pthread_mutex_t* mutex_acquire(pthread_mutex_t* mutex, thread_t* thread) {
+		history_index* index = __atomic_load_n(&_index, __ATOMIC_ACQUIRE);
+		if(index->acqAmount == 0) return mutex;
+		uintptr_t expected = __atomic_load_n((uintptr_t*)mutex, __ATOMIC_ACQUIRE);
+		// only attach to a pristine, unlocked mutex.
+		// Another thread may have attached it since the caller looked, so re-derive the entry.
+		if(expected != 0) return (pthread_mutex_t*)getSyncEntry(mutex);
+		void** miss = &_acqMisses[((uintptr_t)mutex >> 3) & (xdefines::ACQ_MISS_CACHE - 1)];
+		if(__atomic_load_n(miss, __ATOMIC_RELAXED) == mutex) return (pthread_mutex_t*)getSyncEntry(mutex);
+		void* address[xdefines::CALLSITE_LEVEL] = {NULL};
+		getAcquisitionCallsite(thread, address);
+		acq_callsite* site = locateAcqCallsite(index, address[0], address[1]);
+		// outer acquisitions are only recorded with the 1st level
+		if(site == NULL) site = locateAcqCallsite(index, address[0], NULL);
+		if(site == NULL) {
+			// not recorded, stays pristine so the pool is kept for the ones that are
+			__atomic_store_n(miss, mutex, __ATOMIC_RELAXED);
+			return (pthread_mutex_t*)getSyncEntry(mutex);
+		}
+		my_mutex* myMutex = takeRealMutex(thread);
+		if(myMutex == NULL) return (pthread_mutex_t*)getSyncEntry(mutex);
+		memcpy(&myMutex->myMutex, mutex, sizeof(pthread_mutex_t));
+		myMutex->callsite = NULL;
+		// a member of an ordered or gated set has no shared lock
+		if(site->realMutex != NULL) *(uintptr_t*)myMutex = (uintptr_t)site->realMutex;
+		myMutex->specialSlot = site->specialSlot;
+		if(!__atomic_compare_exchange_n((uintptr_t*)mutex, &expected, (uintptr_t)myMutex, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+			// someone else attached it first
+			thread->spareMutex = myMutex;
+			return (pthread_mutex_t*)getSyncEntry(mutex);
+		}
+		if(site->realMutex == NULL) bindMember(site->specialSlot, mutex);
+		else countMapped(site->realMutex);
+		return (pthread_mutex_t*)myMutex;
+	}
+
+	// a mutex is gone, forget it was not recorded
+	INLINE void forgetMiss(pthread_mutex_t* mutex) {
+		void** miss = &_acqMisses[((uintptr_t)mutex >> 3) & (xdefines::ACQ_MISS_CACHE - 1)];
+		if(__atomic_load_n(miss, __ATOMIC_RELAXED) == mutex) __atomic_store_n(miss, NULL, __ATOMIC_RELAXED);
+	}
+
 	INLINE bool checkInDirection(void* mutex) {
 		if((INDIRECTION_MASK & *(uintptr_t*)mutex) != INDIRECTION_MASK) return false;
 		else return true;
@@ -207,12 +362,784 @@ public:
 	
 	int getMergeSetAmount() { return _mergesetAmount; }
 
+	// acquire and release special locks, with their contention recorded
+#ifdef PREVENTION_STATS
+	INLINE int special_lock(pthread_mutex_t* lock) {
+		special_stats* st = &_specialStats[getSpecialLockIndex(lock)];
+		// only a failed trylock pays for reading the clock
+		int ret = WRAP(pthread_mutex_trylock)(lock);
+		if(ret == EBUSY) {
+			uint64_t start = getNanos();
+			ret = lockReal(lock);
+			if(ret == 0) {
+				st->contended++;
+				st->waitNanos += getNanos() - start;
+			}
+		}
+		if(ret == 0) {
+			st->acquisitions++;
+			st->holdStart = getNanos();
+		}
+		return ret;
+	}
+
+	INLINE int special_trylock(pthread_mutex_t* lock) {
+		int ret = WRAP(pthread_mutex_trylock)(lock);
+		if(ret == 0) {
+			special_stats* st = &_specialStats[getSpecialLockIndex(lock)];
+			st->acquisitions++;
+			st->holdStart = getNanos();
+		}
+		return ret;
+	}
+
+	// a cond wait on a special lock is counted in its hold time
+	INLINE int special_unlock(pthread_mutex_t* lock) {
+		special_stats* st = &_specialStats[getSpecialLockIndex(lock)];
+		st->holdNanos += getNanos() - st->holdStart;
+		return WRAP(pthread_mutex_unlock)(lock);
+	}
+
+	void countMapped(void* lock) {
+		__atomic_add_fetch(&_specialStats[getSpecialLockIndex(lock)].mapped, 1, __ATOMIC_RELAXED);
+	}
+#else
+	INLINE int special_lock(pthread_mutex_t* lock) { return lockReal(lock); }
+
+	INLINE int special_trylock(pthread_mutex_t* lock) { return WRAP(pthread_mutex_trylock)(lock); }
+
+	INLINE int special_unlock(pthread_mutex_t* lock) { return WRAP(pthread_mutex_unlock)(lock); }
+
+	void countMapped(void* lock) { }
+#endif
+
+	int getSpecialSlotAmount() { return _specialSlotAmount; }
+
+	// special locks and member slots are assigned from the history file as of this time
+	struct timespec getLoadedMtime() { return _historyMtime; }
+
+	// per-thread counters are allocated with the capacity, so they cover reloaded sets
+	int getSetCapacity() { return _setCapacity; }
+
+	int getSlotCapacity() { return _slotCapacity; }
+
+	special_info_list* getHistorySet(int index) { return _historySets[index]; }
+
+	bool keepsMutex(int slot) { return _orderSlots[slot].ordered || _orderSlots[slot].gated || _orderSlots[slot].avoided; }
+
+	bool isAvoidedSet(int set) { return _orderSlots[_setBase[set]].avoided; }
+
+	int getSlotSet(int slot) { return _orderSlots[slot].set; }
+
+	int getSlotMember(int slot) { return slot - _setBase[_orderSlots[slot].set]; }
+
+	// remember the mutex of a member in an ordered set, so that others can pin it.
+	// Only the 1st one is ordered if a recorded call stack matches several mutexes.
+	void bindMember(int slot, pthread_mutex_t* mutex) {
+		if(!_orderSlots[slot].ordered) return;
+		pthread_mutex_t* expected = NULL;
+		if(!__atomic_compare_exchange_n(&_orderSlots[slot].bound, &expected, mutex, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST) && expected != mutex) {
+			__atomic_add_fetch(&_reboundAmount, 1, __ATOMIC_RELAXED);
+		}
+	}
+
+	// a destroyed member mutex is not pinned any more, the next one created can be bound
+	void unbindMember(int slot, pthread_mutex_t* mutex) {
+		if(!_orderSlots[slot].ordered) return;
+		pthread_mutex_t* expected = mutex;
+		__atomic_compare_exchange_n(&_orderSlots[slot].bound, &expected, NULL, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	}
+
+#ifdef KEEP_MEMBER_MUTEX
+	// acquisitions of a member that keeps its own mutex, pc is the acquisition call site
+	INLINE int member_lock(thread_t* thread, pthread_mutex_t* mutex, pthread_mutex_t* real, void* pc) {
+#ifdef ORDERED_PREVENTION
+		if(_orderSlots[((my_mutex*)real)->specialSlot].ordered) return ordered_lock(thread, mutex, real);
+#endif
+#ifdef CALLSITE_GATE
+		if(_orderSlots[((my_mutex*)real)->specialSlot].gated) return gated_lock(thread, mutex, real, pc);
+#endif
+#ifdef ENABLE_AVOIDANCE
+		if(_orderSlots[((my_mutex*)real)->specialSlot].avoided) return avoided_lock(thread, mutex, real, pc);
+#endif
+		if(!isSingleThread) updateDependency(thread, mutex);
+		return acquireBlocking(thread, mutex, real);
+	}
+
+	INLINE int member_trylock(thread_t* thread, pthread_mutex_t* mutex, pthread_mutex_t* real) {
+#ifdef ORDERED_PREVENTION
+		if(_orderSlots[((my_mutex*)real)->specialSlot].ordered) return ordered_trylock(thread, mutex, real);
+#endif
+		// a trylock never waits, so it needs no gate
+		int ret = WRAP(pthread_mutex_trylock)(real);
+		if(ret == 0 && !isSingleThread) updateDependencyByTryLock(thread, mutex);
+		return ret;
+	}
+
+	INLINE int member_unlock(thread_t* thread, pthread_mutex_t* mutex, pthread_mutex_t* real) {
+#ifdef ORDERED_PREVENTION
+		if(_orderSlots[((my_mutex*)real)->specialSlot].ordered) return ordered_unlock(thread, mutex, real);
+#endif
+#ifdef CALLSITE_GATE
+		if(_orderSlots[((my_mutex*)real)->specialSlot].gated) return gated_unlock(thread, mutex, real);
+#endif
+#ifdef ENABLE_AVOIDANCE
+		if(_orderSlots[((my_mutex*)real)->specialSlot].avoided) return avoided_unlock(thread, mutex, real);
+#endif
+		int ret = WRAP(pthread_mutex_unlock)(real);
+		if(!isSingleThread && ret == 0) updateHoldingSetByUnlock(thread, mutex);
+		return ret;
+	}
+
+	// cond waits on a member, abstime is NULL for an untimed one
+	INLINE int member_wait(thread_t* thread, pthread_cond_t* cond, pthread_mutex_t* mutex, pthread_mutex_t* real, const struct timespec* abstime) {
+#ifdef ORDERED_PREVENTION
+		if(_orderSlots[((my_mutex*)real)->specialSlot].ordered) return ordered_wait(thread, cond, mutex, real, abstime);
+#endif
+#ifdef CALLSITE_GATE
+		if(_orderSlots[((my_mutex*)real)->specialSlot].gated) return gated_wait(thread, cond, mutex, real, abstime);
+#endif
+#ifdef ENABLE_AVOIDANCE
+		if(_orderSlots[((my_mutex*)real)->specialSlot].avoided) return avoided_wait(thread, cond, mutex, real, abstime);
+#endif
+		return condWaitReal(cond, real, abstime);
+	}
+
+	INLINE int condWaitReal(pthread_cond_t* cond, pthread_mutex_t* real, const struct timespec* abstime) {
+		if(abstime == NULL) return WRAP(pthread_cond_wait)(cond, real);
+		return WRAP(pthread_cond_timedwait)(cond, real, abstime);
+	}
+#endif
+
+#ifdef CALLSITE_GATE
+	/*
+	 * A gated set keeps the original mutexes of its members.
+	 * Only acquisitions from the call sites recorded for the cycles take the
+	 * set's special lock first, as the gate, and release it with the member.
+	 * Other paths acquiring the same mutexes keep full parallelism.
+	 * Call sites are matched by the first level only.
+	 */
+	INLINE int gated_lock(thread_t* thread, pthread_mutex_t* mutex, pthread_mutex_t* real, void* pc) {
+		int slot = ((my_mutex*)real)->specialSlot;
+		int set = _orderSlots[slot].set;
+		vector<void*>& sites = _historySets[set]->gateSites;
+		bool gated = binary_search(sites.begin(), sites.end(), pc);
+		if(gated) {
+			if(thread->specialCount[set] == 0) {
+				pthread_mutex_t* gate = getGate(set);
+				if(!isSingleThread) updateDependency(thread, gate);
+				int ret = special_lock(gate);
+				if(ret != 0) {
+					if(!isSingleThread) updateHoldingSetByUnlock(thread, gate);
+					return ret;
+				}
+			}
+			thread->specialCount[set]++;
+			thread->specialHolding[slot]++;
+		}
+		if(!isSingleThread) updateDependency(thread, mutex);
+		int ret = acquireBlocking(thread, mutex, real);
+		if(ret != 0 && gated) leaveGate(thread, slot, set);
+		return ret;
+	}
+
+	INLINE int gated_unlock(thread_t* thread, pthread_mutex_t* mutex, pthread_mutex_t* real) {
+		int slot = ((my_mutex*)real)->specialSlot;
+		int set = _orderSlots[slot].set;
+		int ret = WRAP(pthread_mutex_unlock)(real);
+		if(!isSingleThread && ret == 0) updateHoldingSetByUnlock(thread, mutex);
+		if(thread->specialHolding[slot] > 0) leaveGate(thread, slot, set);
+		return ret;
+	}
+
+	/*
+	 * The gate is released for a wait on a member taken through it,
+	 * so that a signaller coming through the same call sites can get in,
+	 * and taken again before the member when the wait returns.
+	 * It stays held when other gated members of the set are held too:
+	 * taking it again after them would invert the order of gate and member.
+	 */
+	INLINE int gated_wait(thread_t* thread, pthread_cond_t* cond, pthread_mutex_t* mutex, pthread_mutex_t* real, const struct timespec* abstime) {
+		int slot = ((my_mutex*)real)->specialSlot;
+		int set = _orderSlots[slot].set;
+		if(thread->specialHolding[slot] == 0 || thread->specialCount[set] != thread->specialHolding[slot]) return condWaitReal(cond, real, abstime);
+		pthread_mutex_t* gate = getGate(set);
+		special_unlock(gate);
+		int ret = condWaitReal(cond, real, abstime);
+		// back with the member held, release it to follow the gate
+		WRAP(pthread_mutex_unlock)(real);
+		if(special_lock(gate) != 0) {
+			// the member is held without the gate from now on
+			thread->specialCount[set] = thread->specialHolding[slot] = 0;
+			if(!isSingleThread) updateHoldingSetByUnlock(thread, gate);
+		}
+		// the wait must end with the mutex held
+		WRAP(pthread_mutex_lock)(real);
+		return ret;
+	}
+
+	// a gated acquisition of the member is over, the last one of the set releases the gate
+	INLINE void leaveGate(thread_t* thread, int slot, int set) {
+		thread->specialHolding[slot]--;
+		if(--thread->specialCount[set] == 0) {
+			pthread_mutex_t* gate = getGate(set);
+			special_unlock(gate);
+			if(!isSingleThread) updateHoldingSetByUnlock(thread, gate);
+		}
+	}
+
+	INLINE pthread_mutex_t* getGate(int set) { return (pthread_mutex_t*)(_additionalLockAddr + set * _mutexUnit); }
+#endif
+
+#ifdef ENABLE_AVOIDANCE
+	/*
+	 * Avoidance instead of merging: a merge set in history is a deadlock signature,
+	 * made of its members, the call sites recorded for the cycles and the recorded edges.
+	 * Members acquired at those call sites are published per member slot.
+	 * A thread entering the signature, i.e. acquiring a member from one of those
+	 * call sites while holding no such member, is parked while another thread holds
+	 * a member with a recorded edge to this one: that thread may go on to wait for it,
+	 * which closes the cycle. Threads that can't complete it are never parked.
+	 * Parking is bounded, the other thread may wait for a lock held outside the set.
+	 */
+	INLINE int avoided_lock(thread_t* thread, pthread_mutex_t* mutex, pthread_mutex_t* real, void* pc) {
+		int slot = ((my_mutex*)real)->specialSlot;
+		int set = _orderSlots[slot].set;
+		vector<void*>& sites = _historySets[set]->gateSites;
+		bool signature = binary_search(sites.begin(), sites.end(), pc);
+		if(signature) {
+			enterSignature(thread, slot, set, thread->specialCount[set] == 0, 1);
+			thread->specialCount[set]++;
+			thread->specialHolding[slot]++;
+		}
+		if(!isSingleThread) updateDependency(thread, mutex);
+		int ret = acquireBlocking(thread, mutex, real);
+		if(ret != 0 && signature) leaveSignature(thread, slot, set, 1);
+		return ret;
+	}
+
+	INLINE int avoided_unlock(thread_t* thread, pthread_mutex_t* mutex, pthread_mutex_t* real) {
+		int slot = ((my_mutex*)real)->specialSlot;
+		int set = _orderSlots[slot].set;
+		int ret = WRAP(pthread_mutex_unlock)(real);
+		if(!isSingleThread && ret == 0) updateHoldingSetByUnlock(thread, mutex);
+		if(thread->specialHolding[slot] > 0) leaveSignature(thread, slot, set, 1);
+		return ret;
+	}
+
+	/*
+	 * The member is not published during a wait on it, so that a signaller
+	 * entering the signature isn't parked for it. If the waiter holds no other
+	 * member of the set, it enters the signature again before the member is retaken.
+	 */
+	INLINE int avoided_wait(thread_t* thread, pthread_cond_t* cond, pthread_mutex_t* mutex, pthread_mutex_t* real, const struct timespec* abstime) {
+		int slot = ((my_mutex*)real)->specialSlot;
+		int set = _orderSlots[slot].set;
+		int holding = thread->specialHolding[slot];
+		if(holding == 0) return condWaitReal(cond, real, abstime);
+		leaveSignature(thread, slot, set, holding);
+		int ret = condWaitReal(cond, real, abstime);
+		bool entering = thread->specialCount[set] == 0;
+		// back with the member held, don't park holding it
+		if(entering) WRAP(pthread_mutex_unlock)(real);
+		enterSignature(thread, slot, set, entering, holding);
+		thread->specialCount[set] += holding;
+		thread->specialHolding[slot] = holding;
+		// the wait must end with the mutex held
+		if(entering) WRAP(pthread_mutex_lock)(real);
+		return ret;
+	}
+
+	// publish amount acquisitions of the member, an entering one waits till no other thread holds a closing member
+	void enterSignature(thread_t* thread, int slot, int set, bool entering, int amount) {
+		uint64_t start = 0;
+		size_t waited = 0;
+		for(int i = 0; ; i++) {
+			lockSignature(set);
+			if(!entering || !closesSignature(slot, set)) break;
+			if(start == 0) {
+				start = getNanos();
+				thread->avoidParkCount++;
+			} else if(waited > xdefines::AVOIDANCE_PARK_MAX_US * 1000UL) {
+				thread->avoidTimeoutCount++;
+				break;
+			}
+			unlockSignature(set);
+			if(i < xdefines::AVOIDANCE_YIELDS) sched_yield();
+			else usleep(xdefines::AVOIDANCE_SLEEP_US);
+			waited = getNanos() - start;
+		}
+		__atomic_add_fetch(&_avoidHeld[slot], amount, __ATOMIC_RELEASE);
+		unlockSignature(set);
+		thread->avoidParkNanos += waited;
+	}
+
+	// amount acquisitions of the member are over or undone
+	INLINE void leaveSignature(thread_t* thread, int slot, int set, int amount) {
+		thread->specialHolding[slot] -= amount;
+		thread->specialCount[set] -= amount;
+		__atomic_sub_fetch(&_avoidHeld[slot], amount, __ATOMIC_RELEASE);
+	}
+
+	// whether another thread holds a member with a recorded edge to this one.
+	// The thread entering holds none of the set, so every holder is another thread.
+	bool closesSignature(int slot, int set) {
+		int base = _setBase[set];
+		for(uint64_t closers = _orderSlots[slot].closers; closers != 0; closers &= closers - 1) {
+			if(__atomic_load_n(&_avoidHeld[base + __builtin_ctzll(closers)], __ATOMIC_ACQUIRE) > 0) return true;
+		}
+		return false;
+	}
+
+	// only held to check and publish, so spinning is short
+	INLINE void lockSignature(int set) {
+		while(__atomic_test_and_set(&_avoidLocks[set], __ATOMIC_ACQUIRE)) sched_yield();
+	}
+
+	INLINE void unlockSignature(int set) { __atomic_clear(&_avoidLocks[set], __ATOMIC_RELEASE); }
+#endif
+
+#ifdef ORDERED_PREVENTION
+	/*
+	 * Ordered prevention keeps the original mutexes of a merge set.
+	 * Members are ranked by the acquisition order recorded inside the set.
+	 * Before a member is acquired, the lower-ranked members reachable from it
+	 * in the recorded order are pinned (acquired in rank order) by the same thread,
+	 * so a cycle-forming acquisition finds them already held instead of waiting.
+	 * Paths that only acquire members in rank order never pin anything.
+	 * Limitations: sets larger than ORDER_SET_MAX, sets without recorded order,
+	 * and sets whose members can't be told apart still use the shared lock;
+	 * only the 1st mutex bound to a member is ordered; a member not created yet
+	 * can't be pinned.
+	 */
+	INLINE int ordered_lock(thread_t* thread, pthread_mutex_t* mutex, pthread_mutex_t* real) {
+		int slot = ((my_mutex*)real)->specialSlot;
+		order_slot* os = &_orderSlots[slot];
+		if(mutex != os->bound) {
+			if(!isSingleThread) updateDependency(thread, mutex);
+			return acquireBlocking(thread, mutex, real);
+		}
+		if(thread->orderPins[slot] > 0) {
+			// already pinned by this thread
+			thread->specialHolding[slot]++;
+			thread->orderTaken[slot] = 0;
+			return 0;
+		}
+		int ret = 0;
+		uint64_t taken = pinMembers(thread, os, &ret);
+		if(ret == 0) {
+			checkOrder(thread, os);
+			if(!isSingleThread) updateDependency(thread, mutex);
+			ret = acquireBlocking(thread, mutex, real);
+		}
+		if(ret == 0) {
+			thread->specialHolding[slot]++;
+			thread->orderHeld[os->set] |= 1UL << os->rank;
+		}
+		thread->orderTaken[slot] = taken;
+		if(ret != 0) unpinMembers(thread, slot);
+		return ret;
+	}
+
+	INLINE int ordered_trylock(thread_t* thread, pthread_mutex_t* mutex, pthread_mutex_t* real) {
+		int slot = ((my_mutex*)real)->specialSlot;
+		order_slot* os = &_orderSlots[slot];
+		if(mutex == os->bound && thread->orderPins[slot] > 0) {
+			thread->specialHolding[slot]++;
+			thread->orderTaken[slot] = 0;
+			return 0;
+		}
+		int ret = WRAP(pthread_mutex_trylock)(real);
+		if(ret == 0) {
+			if(mutex == os->bound) {
+				thread->specialHolding[slot]++;
+				thread->orderHeld[os->set] |= 1UL << os->rank;
+				thread->orderTaken[slot] = 0;
+			}
+			if(!isSingleThread) updateDependencyByTryLock(thread, mutex);
+		}
+		return ret;
+	}
+
+	INLINE int ordered_unlock(thread_t* thread, pthread_mutex_t* mutex, pthread_mutex_t* real) {
+		int slot = ((my_mutex*)real)->specialSlot;
+		if(mutex != _orderSlots[slot].bound) {
+			int ret = WRAP(pthread_mutex_unlock)(real);
+			if(!isSingleThread && ret == 0) updateHoldingSetByUnlock(thread, mutex);
+			return ret;
+		}
+		int ret = 0;
+		if(thread->specialHolding[slot] > 0) thread->specialHolding[slot]--;
+		// a pinned member is released together with the member that pinned it
+		if(thread->orderPins[slot] == 0) ret = releaseMember(thread, slot);
+		unpinMembers(thread, slot);
+		return ret;
+	}
+
+	// the pins taken for the member are released for the wait as well,
+	// and taken again in rank order before the member
+	INLINE int ordered_wait(thread_t* thread, pthread_cond_t* cond, pthread_mutex_t* mutex, pthread_mutex_t* real, const struct timespec* abstime) {
+		int slot = ((my_mutex*)real)->specialSlot;
+		order_slot* os = &_orderSlots[slot];
+		if(mutex != os->bound || thread->orderTaken[slot] == 0) return condWaitReal(cond, real, abstime);
+		unpinMembers(thread, slot);
+		int ret = condWaitReal(cond, real, abstime);
+		// back with the member held, release it to follow its pins
+		WRAP(pthread_mutex_unlock)(real);
+		if(!isSingleThread) updateHoldingSetByUnlock(thread, mutex);
+		thread->orderHeld[os->set] &= ~(1UL << os->rank);
+		int err = 0;
+		// a member that can't be pinned now is left out, the wait must end with the mutex held
+		thread->orderTaken[slot] = pinMembers(thread, os, &err);
+		if(!isSingleThread) updateDependency(thread, mutex);
+		WRAP(pthread_mutex_lock)(real);
+		thread->orderHeld[os->set] |= 1UL << os->rank;
+		return ret;
+	}
+
+#endif
+
+	// print how prevention behaved, to compare the modes on the same history
+	void reportStats(thread_t* threads, int amount) {
+#ifdef PREVENTION_STATS
+		for(int i = 0; i < _mergesetAmount; i++) {
+			special_stats* st = &_specialStats[i];
+			if(st->acquisitions == 0 && st->mapped == 0) continue;
+			fprintf(stderr, "Special lock #%d %p: %zu mutexes mapped, %zu acquisitions, %zu contended, wait %.3f ms, hold %.3f ms\n",
+					i, (void*)(_additionalLockAddr + i * _mutexUnit), st->mapped, st->acquisitions, st->contended, st->waitNanos / 1e6, st->holdNanos / 1e6);
+		}
+#endif
+#ifdef ORDERED_PREVENTION
+		size_t pins = 0, violations = 0, unbound = 0;
+		for(int i = 0; i < amount; i++) {
+			pins += threads[i].orderPinCount;
+			violations += threads[i].orderViolationCount;
+			unbound += threads[i].orderUnboundCount;
+		}
+		fprintf(stderr, "Ordered prevention: %d of %d merge sets ordered, %zu pins, %zu order violations, %zu unbound pins, %d extra bindings\n",
+				_orderedAmount, _mergesetAmount, pins, violations, unbound, _reboundAmount);
+#endif
+#ifdef ENABLE_AVOIDANCE
+		size_t parks = 0, nanos = 0, timeouts = 0;
+		for(int i = 0; i < amount; i++) {
+			parks += threads[i].avoidParkCount;
+			nanos += threads[i].avoidParkNanos;
+			timeouts += threads[i].avoidTimeoutCount;
+		}
+		fprintf(stderr, "Avoidance: parked %zu times for %.3f ms in total, %zu timeouts\n", parks, nanos / 1e6, timeouts);
+#endif
+	}
+
 private:
-	ifstream _deadlockFile;
+	// decide how a merge set is prevented, by its shared lock if nothing else applies
+	void classifySet(int setIndex) {
+#ifdef ORDERED_PREVENTION
+		if(computeOrder(setIndex)) {
+			_orderedAmount++;
+			return;
+		}
+#endif
+#if defined(CALLSITE_GATE) || defined(ENABLE_AVOIDANCE)
+		// without recorded call sites, the whole set still shares one lock
+		vector<void*>& sites = _historySets[setIndex]->gateSites;
+		if(sites.empty()) return;
+#ifdef ENABLE_AVOIDANCE
+		if(!computeClosers(setIndex)) return;
+#endif
+		sort(sites.begin(), sites.end());
+		for(int i = 0; i < _historySets[setIndex]->count; i++) {
+#ifdef ENABLE_AVOIDANCE
+			_orderSlots[_setBase[setIndex] + i].avoided = true;
+#else
+			_orderSlots[_setBase[setIndex] + i].gated = true;
+#endif
+		}
+#endif
+	}
+
+#ifdef ENABLE_AVOIDANCE
+	// a signature is matched on the recorded edges, sets without them or too large still share one lock
+	bool computeClosers(int index) {
+		special_info_list* sll = _historySets[index];
+		int n = sll->count;
+		if(n > xdefines::ORDER_SET_MAX || sll->edges.empty()) return false;
+		for(size_t e = 0; e < sll->edges.size(); e++) {
+			if(sll->edges[e].first >= n || sll->edges[e].second >= n) return false;
+		}
+		int base = _setBase[index];
+		for(size_t e = 0; e < sll->edges.size(); e++) {
+			int held = sll->edges[e].first;
+			int acquired = sll->edges[e].second;
+			if(held != acquired) _orderSlots[base + acquired].closers |= 1UL << held;
+		}
+		return true;
+	}
+#endif
+
+	// map and initialize the shared locks of new merge sets, the region only grows
+	void growSpecialLocks(int amount) {
+		uintptr_t end = _additionalLockAddr + amount * _mutexUnit;
+		if(end > _additionalLockAddrEnd) {
+			size_t size = alignup(end - _additionalLockAddrEnd, getpagesize());
+			if(MM::mmapAllocatePrivate(size, false, (void*)_additionalLockAddrEnd) == NULL) {
+				fprintf(stderr, "Failed to allocate for the additional locks from %p\n", (void*)_additionalLockAddrEnd);
+				abort();
+			}
+			_additionalLockAddrEnd += size;
+		}
+		pthread_mutexattr_t attr;
+		pthread_mutexattr_init(&attr);
+		for(int index = _mergesetAmount; index < amount; index++) {
+			pthread_mutex_t* mutex = (pthread_mutex_t*)(_additionalLockAddr + index * _mutexUnit);
+			int ret = WRAP(pthread_mutex_init)(mutex, &attr);
+			if(ret != 0) {
+				fprintf(stderr, "Failed to initalize additional locks\n");
+			}
+		}
+	}
+
+	// build the matching index from all merge sets, the 1st set recording a call stack owns it
+	history_index* buildIndex() {
+		history_index* index = new history_index;
+		index->acqMap.initialize(HashFuncs::hashAddr, HashFuncs::compareAddr, xdefines::MAX_SYNC_ITEMS);
+		int setIndex = 0;
+		for(special_info_list* sll = specialList->next; sll != NULL; sll = sll->next, setIndex++) {
+			void* realMutex = (void*)(_additionalLockAddr + _mutexUnit * setIndex);
+			for(auto si = sll->list->next; si != NULL; si = si->next) {
+				special_info* info = si->entry;
+				callstack* cs = info->callsite;
+				if(cs->found > 0) {
+					// this lock is initialzied by init(), mark the end of this 'path' with the shared lock
+					callsite_tree* currentNode = index->tree;
+					index->filter.add(cs->stack[0]);
+					for(int i = 0; i < cs->found; i++) currentNode = currentNode->addChild(cs->stack[i]);
+					if(currentNode->realMutex == NULL) {
+						currentNode->realMutex = realMutex;
+						currentNode->specialSlot = info->specialSlot;
+					}
+				} else {
+					// match it by its acquisition call sites when it is acquired for the 1st time
+					bool ordered = keepsMutex(info->specialSlot);
+					for(acq_callsite* site = info->acqsite; site != NULL; site = site->next) {
+						addAcqCallsite(index, new acq_callsite(site->addr[0], site->addr[1], ordered ? NULL : realMutex, info->specialSlot));
+					}
+				}
+			}
+		}
+		return index;
+	}
+
+	// locks initialized by MACRO that we know nothing else about, in the sets from firstSet on.
+	// Such a lockAddr must be a global mutex that already exists in memory,
+	// do in-direction here, through a real mutex that keeps its member slot.
+	// Only a pristine, unlocked one is redirected, as in mutex_acquire().
+	void redirectGlobals(int firstSet) {
+		for(int setIndex = firstSet; setIndex < _mergesetAmount; setIndex++) {
+			uintptr_t realMutex = _additionalLockAddr + _mutexUnit * setIndex;
+			for(auto si = _historySets[setIndex]->list->next; si != NULL; si = si->next) {
+				special_info* info = si->entry;
+				if(info->callsite->found > 0 || info->acqsite != NULL) continue;
+				uintptr_t expected = 0;
+				if(*(uintptr_t*)info->lock != expected) continue;
+				size_t index = __atomic_fetch_add(&realMutexIndex, 1, __ATOMIC_RELAXED);
+				if(index >= xdefines::MAX_SYNC_OBJ) return;
+				my_mutex* myMutex = realMutexStart + index;
+				bool ordered = keepsMutex(info->specialSlot);
+				myMutex->callsite = NULL;
+				myMutex->specialSlot = info->specialSlot;
+				// keep the original mutex if ordered, only attach the member slot
+				memcpy(&myMutex->myMutex, info->lock, sizeof(pthread_mutex_t));
+				if(!ordered) *(uintptr_t*)myMutex = realMutex;
+				if(!__atomic_compare_exchange_n((uintptr_t*)info->lock, &expected, (uintptr_t)myMutex, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) continue;
+				if(ordered) bindMember(info->specialSlot, (pthread_mutex_t*)info->lock);
+				else countMapped((void*)realMutex);
+			}
+		}
+	}
+
+#ifdef HOT_RELOAD
+	// identify a merge set by its members, to skip the ones already applied
+	string getSetKey(special_info_list* sll) {
+		vector<string> members;
+		char buf[32];
+		for(auto si = sll->list->next; si != NULL; si = si->next) {
+			special_info* info = si->entry;
+			snprintf(buf, sizeof(buf), "%p", info->lock);
+			string member(buf);
+			for(int i = 0; i < info->callsite->found; i++) {
+				snprintf(buf, sizeof(buf), " %p", info->callsite->stack[i]);
+				member += buf;
+			}
+			for(acq_callsite* site = info->acqsite; site != NULL; site = site->next) {
+				snprintf(buf, sizeof(buf), " @%p %p", site->addr[0], site->addr[1]);
+				member += buf;
+			}
+			members.push_back(member);
+		}
+		sort(members.begin(), members.end());
+		string key;
+		for(size_t i = 0; i < members.size(); i++) key += members[i] + "\n";
+		return key;
+	}
+
+#endif
+
+	struct timespec getHistoryMtime() {
+		struct stat st;
+		if(stat(_historyFilename.c_str(), &st) != 0) return timespec();
+		return st.st_mtim;
+	}
+
+#ifdef ORDERED_PREVENTION
+	// rank the members of a set by the reverse postorder of a DFS over the recorded
+	// acquisition order, so that only edges closing a cycle go from high to low rank
+	bool computeOrder(int index) {
+		special_info_list* sll = _historySets[index];
+		int n = sll->count;
+		if(n > xdefines::ORDER_SET_MAX || sll->edges.empty() || !hasDistinctMembers(sll)) return false;
+		uint64_t next[xdefines::ORDER_SET_MAX] = {0};
+		for(size_t e = 0; e < sll->edges.size(); e++) {
+			int held = sll->edges[e].first;
+			int acquired = sll->edges[e].second;
+			if(held >= n || acquired >= n) return false;
+			next[held] |= 1UL << acquired;
+		}
+		int rank[xdefines::ORDER_SET_MAX];
+		uint64_t visited = 0;
+		int pos = n;
+		for(int m = 0; m < n; m++) {
+			if(!(visited & (1UL << m))) orderDfs(m, next, &visited, rank, &pos);
+		}
+		// transitive closure
+		uint64_t reach[xdefines::ORDER_SET_MAX];
+		memcpy(reach, next, sizeof(reach));
+		for(int k = 0; k < n; k++) {
+			for(int m = 0; m < n; m++) {
+				if(reach[m] & (1UL << k)) reach[m] |= reach[k];
+			}
+		}
+		int base = _setBase[index];
+		for(int m = 0; m < n; m++) {
+			order_slot* os = &_orderSlots[base + m];
+			os->ordered = true;
+			os->rank = rank[m];
+			for(int t = 0; t < n; t++) {
+				if((reach[m] & (1UL << t)) && rank[t] < rank[m]) os->pinMask |= 1UL << rank[t];
+			}
+			_rankSlot[base + rank[m]] = base + m;
+		}
+		return true;
+	}
+
+	void orderDfs(int m, uint64_t* next, uint64_t* visited, int* rank, int* pos) {
+		*visited |= 1UL << m;
+		for(uint64_t succ = next[m] & ~*visited; succ != 0; succ = next[m] & ~*visited) {
+			orderDfs(__builtin_ctzll(succ), next, visited, rank, pos);
+		}
+		rank[m] = --(*pos);
+	}
+
+	// members sharing an init call stack or an acquisition call site can't be ordered
+	bool hasDistinctMembers(special_info_list* sll) {
+		for(auto a = sll->list->next; a != NULL; a = a->next) {
+			for(auto b = a->next; b != NULL; b = b->next) {
+				callstack* sa = a->entry->callsite;
+				callstack* sb = b->entry->callsite;
+				if(sa->found > 0 && sa->found == sb->found && memcmp(sa->stack, sb->stack, sa->found * sizeof(void*)) == 0) return false;
+				for(acq_callsite* x = a->entry->acqsite; x != NULL; x = x->next) {
+					for(acq_callsite* y = b->entry->acqsite; y != NULL; y = y->next) {
+						if(x->addr[0] == y->addr[0] && x->addr[1] == y->addr[1]) return false;
+					}
+				}
+			}
+		}
+		return true;
+	}
+
+	// a member acquired while a higher-ranked one of the same set is held
+	INLINE void checkOrder(thread_t* thread, order_slot* os) {
+		if(thread->orderHeld[os->set] >> os->rank >> 1) thread->orderViolationCount++;
+	}
+
+	// pin the lower-ranked members reachable from os in rank order, returns the ranks pinned.
+	// Stops at the 1st failed acquisition, with its error in err.
+	uint64_t pinMembers(thread_t* thread, order_slot* os, int* err) {
+		uint64_t taken = 0;
+		for(uint64_t pins = os->pinMask; pins != 0; pins &= pins - 1) {
+			int target = _rankSlot[_setBase[os->set] + __builtin_ctzll(pins)];
+			int ret = pinMember(thread, target);
+			if(ret == ENOENT) continue;
+			if(ret != 0) {
+				*err = ret;
+				break;
+			}
+			taken |= pins & (~pins + 1);
+		}
+		return taken;
+	}
+
+	// acquire a lower-ranked member on behalf of another one, ENOENT if no mutex is bound to it
+	int pinMember(thread_t* thread, int slot) {
+		order_slot* os = &_orderSlots[slot];
+		pthread_mutex_t* mutex = __atomic_load_n(&os->bound, __ATOMIC_ACQUIRE);
+		if(mutex == NULL) {
+			// not created yet, or destroyed
+			thread->orderUnboundCount++;
+			return ENOENT;
+		}
+		if(thread->orderPins[slot] == 0 && thread->specialHolding[slot] == 0) {
+			checkOrder(thread, os);
+			if(!isSingleThread) updateDependency(thread, mutex);
+			int ret = acquireBlocking(thread, mutex, (pthread_mutex_t*)getSyncEntry(mutex));
+			if(ret != 0) return ret;
+			thread->orderHeld[os->set] |= 1UL << os->rank;
+			thread->orderPinCount++;
+		}
+		thread->orderPins[slot]++;
+		return 0;
+	}
+
+	void unpinMembers(thread_t* thread, int slot) {
+		int base = _setBase[_orderSlots[slot].set];
+		for(uint64_t pins = thread->orderTaken[slot]; pins != 0; pins &= pins - 1) {
+			int target = _rankSlot[base + __builtin_ctzll(pins)];
+			if(--thread->orderPins[target] == 0 && thread->specialHolding[target] == 0) releaseMember(thread, target);
+		}
+		thread->orderTaken[slot] = 0;
+	}
+
+	int releaseMember(thread_t* thread, int slot) {
+		order_slot* os = &_orderSlots[slot];
+		int ret = WRAP(pthread_mutex_unlock)((pthread_mutex_t*)getSyncEntry(os->bound));
+		if(!isSingleThread && ret == 0) updateHoldingSetByUnlock(thread, os->bound);
+		thread->orderHeld[os->set] &= ~(1UL << os->rank);
+		return ret;
+	}
+#endif
+
+	string _historyFilename;
 	size_t _mutexUnit;
-	// for locks initialized by init(), record the call site of init()
-	callsite_tree *_callsiteTree;	
+	history_index* _index; // replaced as a whole by a reload, old ones are never freed
+	void* _acqMisses[xdefines::ACQ_MISS_CACHE]; // pristine mutexes acquired at no recorded site
+	bool _poolWarned;
 	int _mergesetAmount;
+	int _specialSlotAmount; // how many locks in all merge sets
+	int _setCapacity;
+	int _slotCapacity;
+#ifdef HOT_RELOAD
+	set<string> _appliedSets; // keys of the merge sets already applied
+#endif
+	struct timespec _historyMtime; // of the history file when it was read last time
+	bool _offline;
+	vector<special_info_list*> _historySets; // merge sets in history, by index
+	vector<int> _setBase; // the 1st member slot of every merge set
+	order_slot* _orderSlots; // per member slot
+	int* _rankSlot; // member slot by (1st member slot of its set + rank)
+	int _orderedAmount; // how many merge sets are ordered instead of merged
+	int _reboundAmount; // mutexes matching a member that is already bound
+	int* _avoidHeld; // per member slot, acquisitions at the recorded call sites being held
+	char* _avoidLocks; // per merge set, taken to check and publish an entering acquisition
+	special_stats* _specialStats; // per merge set
 	uintptr_t _additionalLockAddr;
 	uintptr_t _additionalLockAddrEnd;
 
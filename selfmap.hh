@@ -163,7 +163,8 @@ class selfmap {
         // It is more clean that that of using readlink. 
         // readlink will have some additional bytes after the executable file 
         // if there are parameters.	
-				if(!gotMainExe) {
+				// skip anonymous mappings placed below the executable, e.g. the additional locks
+				if(!gotMainExe && m.getFile().size() > 0 && m.getFile()[0] == '/') {
 					_main_exe = std::string(m.getFile());
 					gotMainExe = true;
 				}
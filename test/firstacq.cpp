@@ -0,0 +1,73 @@
+#include <stdio.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <stdlib.h>
+
+// Two threads race on the first acquisition of zero-initialized mutexes.
+// Every round adds a dependency per thread, stay below MAX_DEPENDENCY.
+// Run it twice: the 1st run records the cycle of lockPair,
+// the 2nd one attaches real mutexes at its call sites while both threads race.
+
+#define ROUNDS 2000
+
+pthread_mutex_t* l;
+pthread_barrier_t barrier;
+int counter = 0;
+
+void lockPair(pthread_mutex_t* a, pthread_mutex_t* b)
+{
+	pthread_mutex_lock(a);
+	pthread_mutex_lock(b); // deadlock_1
+	counter++;
+	pthread_mutex_unlock(b);
+	pthread_mutex_unlock(a);
+}
+
+void *threadProcAB(void* arg)
+{
+	lockPair(&l[0], &l[1]);
+	return NULL;
+}
+
+void *threadProcBA(void* arg)
+{
+	lockPair(&l[1], &l[0]);
+	return NULL;
+}
+
+void *threadProcRace(void* arg)
+{
+	for(int i = 1; i <= ROUNDS; i++) {
+		pthread_barrier_wait(&barrier);
+		lockPair(&l[2 * i], &l[2 * i + 1]);
+	}
+	return NULL;
+}
+
+int main()
+{
+	pthread_t thread[2];
+
+	l = (pthread_mutex_t*)calloc(2 * (ROUNDS + 1), sizeof(pthread_mutex_t));
+	pthread_barrier_init(&barrier, NULL, 2);
+
+	// the cycle, one thread after the other
+	pthread_create(&thread[0], NULL, threadProcAB, NULL);
+	pthread_join(thread[0], NULL);
+	pthread_create(&thread[1], NULL, threadProcBA, NULL);
+	pthread_join(thread[1], NULL);
+
+	// every round starts on a fresh pair
+	for(int i = 0; i < 2; i++) {
+		pthread_create(&thread[i], NULL, threadProcRace, NULL);
+	}
+	for(int i = 0; i < 2; i++) {
+		pthread_join(thread[i], NULL);
+	}
+
+	if(counter != 2 * ROUNDS + 2) {
+		fprintf(stderr, "Lost updates: %d instead of %d\n", counter, 2 * ROUNDS + 2);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,94 @@
+/* Copyright (C)
+* 2017 - Jinpeng Zhou, Jinpeng.Zhou@utsa.edu
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU General Public License
+* as published by the Free Software Foundation; either version 2
+* of the License, or (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; if not, write to the Free Software
+* Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*
+*/
+/**
+* @file threadregistry.hh
+* @brief Dense registry of live thread records.
+* @author Jinpeng Zhou, Jinpeng.Zhou@utsa.edu
+*/
+#ifndef __THREADREGISTRY_HH__
+#define __THREADREGISTRY_HH__
+
+#include "xdefines.hh"
+
+/*
+ * Indexes of live thread records, packed at the front of an array, so scans cost
+ * O(live threads) however many records were reused.
+ * Changes come with the thread index lock held, readers take a copy under a sequence
+ * counter and never block.
+ */
+class threadregistry {
+private:
+	threadregistry() { }
+
+public:
+	static threadregistry& getInstance() {
+		static char buf[sizeof(threadregistry)];
+		static threadregistry* theOneTrueObject = new (buf) threadregistry();
+		return *theOneTrueObject;
+	}
+
+	void initialize() {
+		_count = 0;
+		_seq = 0;
+	}
+
+	void add(int index) {
+		beginUpdate();
+		_position[index] = _count;
+		_live[_count++] = index;
+		endUpdate();
+	}
+
+	// the last one fills the hole
+	void remove(int index) {
+		beginUpdate();
+		int position = _position[index];
+		int last = _live[--_count];
+		_live[position] = last;
+		_position[last] = position;
+		endUpdate();
+	}
+
+	// copy live indexes into live, return how many
+	int snapshot(int* live) {
+		while(true) {
+			size_t seq = __atomic_load_n(&_seq, __ATOMIC_ACQUIRE);
+			if(seq & 1) continue;
+			int count = __atomic_load_n(&_count, __ATOMIC_RELAXED);
+			for(int i = 0; i < count; i++) live[i] = __atomic_load_n(&_live[i], __ATOMIC_RELAXED);
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if(__atomic_load_n(&_seq, __ATOMIC_RELAXED) == seq) return count;
+		}
+	}
+
+private:
+	void beginUpdate() {
+		__atomic_store_n(&_seq, _seq + 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+	}
+
+	void endUpdate() {
+		__atomic_store_n(&_seq, _seq + 1, __ATOMIC_RELEASE);
+	}
+
+	size_t _seq; // odd while changing
+	int _count;
+	int _live[xdefines::MAX_THREADS];
+	int _position[xdefines::MAX_THREADS]; // index -> position in _live
+};
+#endif
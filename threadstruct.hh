@@ -24,8 +24,28 @@
 #ifndef __THREADSTRUCT_HH__
 #define __THREADSTRUCT_HH__
 #include <execinfo.h>
+#include <errno.h>
 
 #include "xdefines.hh"
+#ifdef ONLINE_DETECTION
+#include "lockgraph.hh"
+#endif
+#ifdef LOCK_CLASS
+#include "lockclass.hh"
+#endif
+#ifdef LOCK_PROFILE
+#include "lockprofile.hh"
+#endif
+#ifdef ENABLE_TRACE
+#include "tracer.hh"
+#endif
+#ifdef LIVE_STATS
+#include "livestats.hh"
+// a plain store by the thread owning the record
+#define LIVE_STAT(thread, counter) ((thread)->stats->counter++)
+#else
+#define LIVE_STAT(thread, counter)
+#endif
 
 /*
  * thread_t is the thread related information
@@ -39,8 +59,39 @@ typedef struct {
 	Dependency* curDep; // current dependency
 	DependencyAddrHashMap* dependencyMap; // per thread dependency hashmap
 	void** holdingSet; // current holding
+	void** holdingCallsite; // where each held lock was acquired
 	int holdingCount;
-	special_holding* specialHolding; // mark special locks
+	size_t holdingSeq; // odd while the holdings or curDep are changing
+	int* specialHolding; // per member slot counter on special locks
+	int* specialCount; // per merge set counter on special locks
+	my_mutex* spareMutex; // taken from the pool but not attached, used first next time
+#ifdef ORDERED_PREVENTION
+	int* orderPins; // per member slot, pins held on behalf of other members
+	uint64_t* orderTaken; // per member slot, ranks pinned when it was acquired
+	uint64_t* orderHeld; // per merge set, ranks of held members
+	size_t orderPinCount;
+	size_t orderViolationCount;
+	size_t orderUnboundCount;
+#endif
+#ifdef ENABLE_AVOIDANCE
+	size_t avoidParkCount; // how many times the thread was parked
+	size_t avoidParkNanos;
+	size_t avoidTimeoutCount; // parked too long, acquired anyway
+#endif
+#ifdef WAIT_FOR_GRAPH
+	void* blockedOn; // lock of the blocking acquisition, as in the holding set
+	size_t blockEpoch; // bumped by every blocking acquisition
+#endif
+#ifdef DEADLOCK_RECOVERY
+	pthread_t self;
+	size_t victimEpoch; // the blocking acquisition to give up
+#endif
+#ifdef LIVE_STATS
+	thread_stats* stats; // in the shared segment
+#endif
+#ifdef ENABLE_TRACE
+	trace_ring* trace;
+#endif
 	bool isRecursive; // avoid recursively intercepting
 	void* stackTop; // thread's srtack top
 	OffsetHashMap* offsetMap; // offset hashMap for acquisition
@@ -54,9 +105,64 @@ typedef struct {
 	char align[48];
 } real_thread_t;
 
+// holdings of a thread as seen by the monitor thread at once
+typedef struct {
+	size_t seq;
+	int holdingCount;
+	Dependency* curDep;
+	void* holdingSet[xdefines::MAX_HOLDING_DEPTH];
+} holding_snapshot;
+
+// the owner thread brackets every change of its holdings, stores only
+INLINE void beginHoldingUpdate(thread_t* thread) {
+	__atomic_store_n(&thread->holdingSeq, thread->holdingSeq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+INLINE void endHoldingUpdate(thread_t* thread) {
+	__atomic_store_n(&thread->holdingSeq, thread->holdingSeq + 1, __ATOMIC_RELEASE);
+}
+
+// retry while the thread is changing its holdings, false if it keeps changing
+INLINE bool takeSnapshot(thread_t* thread, holding_snapshot* snapshot) {
+	for(int retry = 0; retry < xdefines::SNAPSHOT_RETRY_MAX; retry++) {
+		size_t seq = __atomic_load_n(&thread->holdingSeq, __ATOMIC_ACQUIRE);
+		if(seq & 1) continue;
+		int hc = __atomic_load_n(&thread->holdingCount, __ATOMIC_RELAXED);
+		void** holdingSet = __atomic_load_n(&thread->holdingSet, __ATOMIC_RELAXED);
+		if(hc < 0 || hc > xdefines::MAX_HOLDING_DEPTH || (hc > 0 && holdingSet == NULL)) continue;
+		for(int i = 0; i < hc; i++) snapshot->holdingSet[i] = __atomic_load_n(&holdingSet[i], __ATOMIC_RELAXED);
+		snapshot->curDep = __atomic_load_n(&thread->curDep, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if(__atomic_load_n(&thread->holdingSeq, __ATOMIC_RELAXED) != seq) continue;
+		snapshot->seq = seq;
+		snapshot->holdingCount = hc;
+		return true;
+	}
+	return false;
+}
+
+// dep is the dependency formed by this acquisition, NULL if none
+INLINE void pushHolding(thread_t* thread, void* lock, void* callsite, Dependency* dep) {
+	beginHoldingUpdate(thread);
+	if(dep != NULL) thread->curDep = dep;
+	thread->holdingCallsite[thread->holdingCount] = callsite;
+	thread->holdingSet[thread->holdingCount++] = lock;
+	endHoldingUpdate(thread);
+}
+
 extern void* textTop;
 extern void* mainTop;
 
+#ifdef LOCK_CLASS
+// dependencies are recorded on lock classes, site is where the caller is.
+// Shared locks of merge sets stand for their sets already.
+INLINE void* getLockClass(void* lock, void* site) {
+	if((INDIRECTION_MASK & (uintptr_t)lock) == INDIRECTION_MASK) return lock;
+	return lockclass::getInstance().getClass(lock, site);
+}
+#endif
+
 #ifdef ENABLE_PREVENTION
 extern my_mutex* realMutexStart;
 extern my_mutex* realMutexEnd;
@@ -83,6 +189,9 @@ INLINE void updateMutexInitCallstack(void* mutex, void* lock, thread_t* thread,
 
 // update dependency info when meet a cond
 INLINE void updateDependencyWithCond(thread_t* thread, void* lock) {
+#ifdef LOCK_CLASS
+	lock = getLockClass(lock, __builtin_return_address(0));
+#endif
 	void** currentHolding = thread->holdingSet;
 	int hc = thread->holdingCount;
 	if(hc >= 2) {
@@ -91,6 +200,7 @@ INLINE void updateDependencyWithCond(thread_t* thread, void* lock) {
 		Dependency* dep;
 		for(int i = hc - 1; i > 0; i--) {
 			void* addrCombined = (void*)((uintptr_t)currentHolding[i] ^ (uintptr_t)currentHolding[i - 1]);
+			LIVE_STAT(thread, hashProbes);
 			if(!depMap->find((void*)addrCombined, 8, &dhl)) {
 				fprintf(stderr, "Error. Not found dependencies in per-thread hash\n");
 				abort();
@@ -109,25 +219,49 @@ INLINE void updateDependencyWithCond(thread_t* thread, void* lock) {
 }
 #endif
 
+// get the call site of current acquisition, same as the one recorded in Dependency::callerAddr
+INLINE void getAcquisitionCallsite(thread_t* thread, void** address) {
+	// backtrace		
+	void* addr[xdefines::ACQ_CALLSTACK_DEPTH]= {NULL};
+	thread->isRecursive = true;
+	int len = backtrace(addr, xdefines::ACQ_CALLSTACK_DEPTH);
+	thread->isRecursive = false;
+	LIVE_STAT(thread, backtraces);
+	for(int i = 0, t = 0; i < len && t < xdefines::CALLSITE_LEVEL && addr[i + 1] != mainTop; i++) {
+		if(addr[i] < textTop) address[t++] = addr[i];
+	}
+}
+
 // update denpendencies when there's a lock()
 INLINE void updateDependency(thread_t* thread, void* lock) {
+#ifdef LOCK_CLASS
+	lock = getLockClass(lock, __builtin_return_address(0));
+#endif
 	void** currentHolding = thread->holdingSet;
 	int* hc = &thread->holdingCount;
+	Dependency* dep = NULL;
 	if(*hc > 0) {
 		// now we have a nested lock
+		LIVE_STAT(thread, nestedAcquisitions);
 		void* addrCombined = (void*)((uintptr_t)lock ^ (uintptr_t)currentHolding[*hc - 1]);
 		DependencyAddrHashMap* depMap = thread->dependencyMap;
 		DependencyHashList* dhl;
-		Dependency* dep;
+		LIVE_STAT(thread, hashProbes);
 		if(!depMap->find((void*)addrCombined, 8, &dhl)) {
 			// new dependency
-			dep = &thread->dependencies[thread->depCount++];
+			dep = &thread->dependencies[thread->depCount];
 #ifdef ENABLE_PREVENTION
 			void* realLock = getSyncEntry(lock);
 			if(realLock != lock) dep->update(lock, realLock, currentHolding, *hc);
 			else dep->update(lock, 0, currentHolding, *hc);
 #else
 			dep->update(lock, currentHolding, *hc);
+#endif
+			// the monitor thread may read it as soon as it is counted
+			__atomic_store_n(&thread->depCount, thread->depCount + 1, __ATOMIC_RELEASE);
+			LIVE_STAT(thread, newDependencies);
+#ifdef ONLINE_DETECTION
+			lockgraph::getInstance().addDependency(thread->tIndex, lock, currentHolding, *hc);
 #endif
 			dhl = new DependencyHashList;
 			dhl->insertToTail(dep);
@@ -136,19 +270,22 @@ INLINE void updateDependency(thread_t* thread, void* lock) {
 			// may exist. Further check
 			if(!dhl->hasEntry(lock, currentHolding, *hc, &dep)) {
 				// not exist. It's new
-				dep = &thread->dependencies[thread->depCount++];
+				dep = &thread->dependencies[thread->depCount];
 #ifdef ENABLE_PREVENTION
 				void* realLock = getSyncEntry(lock);
 				if(realLock != lock) dep->update(lock, realLock, currentHolding, *hc);
 				else dep->update(lock, 0, currentHolding, *hc);
 #else
 				dep->update(lock, currentHolding, *hc);
+#endif
+				__atomic_store_n(&thread->depCount, thread->depCount + 1, __ATOMIC_RELEASE);
+				LIVE_STAT(thread, newDependencies);
+#ifdef ONLINE_DETECTION
+				lockgraph::getInstance().addDependency(thread->tIndex, lock, currentHolding, *hc);
 #endif
 				dhl->insertToTail(dep);
 			}
 		}
-		// update current dependency
-		thread->curDep = dep;
 		// check whether need to get call stacks
 		unsigned long esp;
 		GET_ESP(esp);
@@ -156,6 +293,7 @@ INLINE void updateDependency(thread_t* thread, void* lock) {
 		uintptr_t offset = (unsigned long)thread->stackTop - esp;
 		void* combined = (void*)(offset ^ (uintptr_t)lock);
 		OffsetInfoList* oil;
+		LIVE_STAT(thread, hashProbes);
 		if(!offsetMap->find(combined, 8, &oil)) {
 			// new
 			oil = new OffsetInfoList;
@@ -163,28 +301,21 @@ INLINE void updateDependency(thread_t* thread, void* lock) {
 		} else {
 			if(oil->hasEntry(offset, lock)) {
 				// already exist, no need to get callstack again
-				currentHolding[(*hc)++] = lock;
+				LIVE_STAT(thread, callsiteHits);
+				pushHolding(thread, lock, __builtin_return_address(0), dep);
 				return;
 			}
 		}
 		// new one, get call stack for the 1st time
 		oil->insertToTail(new OffsetInfo(offset, lock));
-		// backtrace		
-		void* addr[xdefines::ACQ_CALLSTACK_DEPTH]= {NULL};
-		thread->isRecursive = true;
-		int len = backtrace(addr, xdefines::ACQ_CALLSTACK_DEPTH);
-		thread->isRecursive = false;
-#if 1
 		void* address[xdefines::CALLSITE_LEVEL] = {NULL};
-		for(int i = 0, t = 0; i < len && t < xdefines::CALLSITE_LEVEL && addr[i + 1] != mainTop; i++) {
-			if(addr[i] < textTop) address[t++] = addr[i];
-		}
+		getAcquisitionCallsite(thread, address);
 		dep->addNewCallsite(address[0], address[1]);
-#else
-		dep->addNewCallsite(addr[1], addr[2]);
-#endif
+		for(int i = 0; i < *hc; i++) {
+			if(thread->holdingCallsite[i] < textTop) dep->addHoldingCallsite(i, thread->holdingCallsite[i]);
+		}
 	}
-	currentHolding[(*hc)++] = lock;
+	pushHolding(thread, lock, __builtin_return_address(0), dep);
 }
 
 #ifdef ENABLE_PREVENTION
@@ -192,39 +323,49 @@ extern int mutexUnit;
 
 INLINE int getSpecialLockIndex(void* lock) { return ((uintptr_t)lock - ADDITIONAL_LOCK_STARTADDR) / mutexUnit; }
 
-INLINE bool updateSpecialByLock(thread_t* thread, void* lock, void* originalLock) {
-	special_holding* sl = &thread->specialHolding[getSpecialLockIndex(lock)];
-	sl->updateByLock(originalLock);
-	if(sl->count == 1) {
-		return true; // 1st lock on the special
-	}
-	return false;
+// real is the mutex attached to the original lock, which keeps its member slot
+INLINE bool updateSpecialByLock(thread_t* thread, void* lock, my_mutex* real) {
+	thread->specialHolding[real->specialSlot]++;
+	// 1st lock on the special
+	return thread->specialCount[getSpecialLockIndex(lock)]++ == 0;
 }
 
-INLINE bool updateSpecialByUnLock(thread_t* thread, void* lock, void* originalLock) {
-	special_holding* sl = &thread->specialHolding[getSpecialLockIndex(lock)];
-	sl->updateByUnLock(originalLock);
-	if(sl->count == 0) {
-		return true; // last lock on the special
+INLINE bool updateSpecialByUnLock(thread_t* thread, void* lock, my_mutex* real) {
+	int* count = &thread->specialCount[getSpecialLockIndex(lock)];
+	int* holding = &thread->specialHolding[real->specialSlot];
+	if(*holding > 0) {
+		(*holding)--;
+		(*count)--;
 	}
-	return false;
+	// last lock on the special
+	return *count == 0;
 }
 #endif
 
 // trylocks only update holding set
 INLINE void updateDependencyByTryLock(thread_t* thread, void* lock) {
-	int* hc = &thread->holdingCount;
-	thread->holdingSet[(*hc)++] = lock;
+#ifdef LOCK_CLASS
+	lock = getLockClass(lock, __builtin_return_address(0));
+#endif
+	pushHolding(thread, lock, __builtin_return_address(0), NULL);
 }
 
 INLINE void updateHoldingSetByUnlock(thread_t* thread, void* lock) {
+#ifdef LOCK_CLASS
+	lock = getLockClass(lock, __builtin_return_address(0));
+#endif
 	void** currentHolding = thread->holdingSet;
 	int* hc = &thread->holdingCount;
 	int last = *hc - 1;
 	for(int i = last; i >= 0; i--) {
 		if(currentHolding[i] == lock) {
-			for(int j = i; j < last; j++) currentHolding[j] = currentHolding[j + 1];
+			beginHoldingUpdate(thread);
+			for(int j = i; j < last; j++) {
+				currentHolding[j] = currentHolding[j + 1];
+				thread->holdingCallsite[j] = thread->holdingCallsite[j + 1];
+			}
 			(*hc)--;
+			endHoldingUpdate(thread);
 			break;
 		}
 	}
@@ -240,6 +381,80 @@ INLINE int getThreadIndexFromStack(uintptr_t stackTop) {
 	return index;
 }
 
+#ifdef WAIT_FOR_GRAPH
+// published just before blocking, after the lock is in the holding set
+INLINE void publishBlocked(thread_t* thread, void* lock) {
+	__atomic_store_n(&thread->blockEpoch, thread->blockEpoch + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&thread->blockedOn, lock, __ATOMIC_RELEASE);
+}
+
+INLINE void clearBlocked(thread_t* thread) {
+	__atomic_store_n(&thread->blockedOn, NULL, __ATOMIC_RELEASE);
+}
+#endif
+
+#ifdef DEADLOCK_RECOVERY
+extern thread_t* threadsInfo;
+
+// the monitor thread picked the blocking acquisition of this thread to break a deadlock
+INLINE bool isVictim() {
+	int index = getThreadIndexFromStack((uintptr_t)&index);
+	thread_t* thread = &threadsInfo[index];
+	if(thread->blockedOn == NULL || __atomic_load_n(&thread->victimEpoch, __ATOMIC_ACQUIRE) != thread->blockEpoch) return false;
+	__atomic_store_n(&thread->victimEpoch, 0, __ATOMIC_RELAXED);
+	return true;
+}
+#endif
+
+#if defined(EVENT_MONITOR) || defined(DEADLOCK_RECOVERY)
+#ifdef MONITOR_EVENTFD
+extern int monitorEvent;
+#endif
+
+// a timed wait after a failed trylock, in slices of BLOCK_THRESHOLD_MS.
+// The 1st slice timing out wakes the monitor thread, a victim gives up between slices.
+INLINE int lockReal(pthread_mutex_t* real) {
+	int ret = WRAP(pthread_mutex_trylock)(real);
+	if(ret != EBUSY) return ret;
+	for(int slice = 0; ; slice++) {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += xdefines::BLOCK_THRESHOLD_MS * 1000000L;
+		if(ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		ret = WRAP(pthread_mutex_timedlock)(real, &ts);
+		if(ret != ETIMEDOUT) return ret;
+#ifdef EVENT_MONITOR
+		uint64_t one = 1;
+		if(slice == 0 && write(monitorEvent, &one, sizeof(one)) < 0) { }
+#endif
+#ifdef DEADLOCK_RECOVERY
+		if(isVictim()) return EDEADLK;
+#else
+		return WRAP(pthread_mutex_lock)(real);
+#endif
+	}
+}
+#else
+INLINE int lockReal(pthread_mutex_t* real) { return WRAP(pthread_mutex_lock)(real); }
+#endif
+
+// acquire the real mutex of lock, which may block
+INLINE int acquireBlocking(thread_t* thread, void* lock, pthread_mutex_t* real) {
+#ifdef WAIT_FOR_GRAPH
+	publishBlocked(thread, lock);
+	int ret = lockReal(real);
+	clearBlocked(thread);
+	// not acquired, so not held
+	if(ret == EDEADLK) updateHoldingSetByUnlock(thread, lock);
+	return ret;
+#else
+	return lockReal(real);
+#endif
+}
+
 #if defined(ENABLE_PREVENTION) && defined(ENABLE_ANALYZER)
 // set up connection between mutex and real_mutex
 INLINE int setSyncEntry(void* syncvar, void* realvar) {
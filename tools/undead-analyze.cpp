@@ -0,0 +1,358 @@
+/* Copyright (C)
+* 2017 - Jinpeng Zhou, Jinpeng.Zhou@utsa.edu
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU General Public License
+* as published by the Free Software Foundation; either version 2
+* of the License, or (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; if not, write to the Free Software
+* Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*
+*/
+/**
+* @file undead-analyze.cpp
+* @brief Run the analysis at exit of UnDead on a dependency dump (-DDUMP_DEPENDENCIES)
+*        or a trace (-DENABLE_TRACE), and write the report and the history file of the program.
+* @author Jinpeng Zhou, Jinpeng.Zhou@utsa.edu
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "xdefines.hh"
+#include "threadstruct.hh"
+#include "analyzer.hh"
+#include "tracer.hh"
+#include "depdump.hh"
+
+using namespace std;
+
+// what libundead.so defines for the headers
+thread_t *threadsInfo;
+real_thread_t *threadsInfoReal;
+uintptr_t globalStackAddr;
+volatile int aliveThreads;
+bool isSingleThread;
+int mutexUnit;
+void* mainTop;
+void* textTop;
+my_mutex* realMutexStart;
+my_mutex* realMutexEnd;
+size_t realMutexIndex;
+bool enablePrevention;
+
+// nothing is interposed here
+int (*WRAP(pthread_create))(pthread_t*, const pthread_attr_t*, void *(*)(void*), void*) = pthread_create;
+int (*WRAP(pthread_join))(pthread_t, void**) = pthread_join;
+int (*WRAP(pthread_mutex_init))(pthread_mutex_t*, const pthread_mutexattr_t*) = pthread_mutex_init;
+int (*WRAP(pthread_mutex_destroy))(pthread_mutex_t*) = pthread_mutex_destroy;
+int (*WRAP(pthread_mutex_lock))(pthread_mutex_t*) = pthread_mutex_lock;
+int (*WRAP(pthread_mutex_unlock))(pthread_mutex_t*) = pthread_mutex_unlock;
+int (*WRAP(pthread_mutex_trylock))(pthread_mutex_t*) = pthread_mutex_trylock;
+int (*WRAP(pthread_mutex_timedlock))(pthread_mutex_t*, const struct timespec*) = pthread_mutex_timedlock;
+int (*WRAP(pthread_cond_timedwait))(pthread_cond_t*, pthread_mutex_t*, const struct timespec*) = pthread_cond_timedwait;
+int (*WRAP(pthread_cond_wait))(pthread_cond_t*, pthread_mutex_t*) = pthread_cond_wait;
+
+static string programPath;
+
+static INLINE bool isSpecialLock(void* lock) {
+	return (INDIRECTION_MASK & (uintptr_t)lock) == INDIRECTION_MASK;
+}
+
+// reports and history are named after the program, as in the process
+static void setProgram(const string& program) {
+	programPath = program;
+	__progname_full = (char*)programPath.c_str();
+	prevention::getInstance().initialize(true);
+}
+
+static bool readAll(FILE* file, void* data, size_t size) {
+	return size == 0 || fread(data, size, 1, file) == 1;
+}
+
+/*
+ * A dump holds the records as they were at exit. Special locks and member slots are
+ * only valid with the history file they were assigned from, the dependencies on them
+ * are dropped if it changed since.
+ */
+static int loadDump(FILE* file, int* pid) {
+	dep_dump_header header;
+	if(!readAll(file, &header, sizeof(header)) || header.version != xdefines::DEP_DUMP_VERSION) {
+		fprintf(stderr, "Unknown dependency dump version\n");
+		return -1;
+	}
+	if(header.records > xdefines::MAX_THREADS) {
+		fprintf(stderr, "Too many records in the dump: %u\n", header.records);
+		return -1;
+	}
+	header.program[sizeof(header.program) - 1] = '\0';
+	setProgram(programPath.empty() ? string(header.program) : programPath);
+	*pid = header.pid;
+	struct timespec mtime = prevention::getInstance().getLoadedMtime();
+	bool stale = mtime.tv_sec != header.historySec || mtime.tv_nsec != header.historyNsec;
+	size_t dropped = 0;
+	map<void*, my_mutex*> realLocks; // one per lock, as in the process
+	for(uint32_t i = 0; i < header.records; i++) {
+		uint64_t count;
+		if(!readAll(file, &count, sizeof(count)) || count > xdefines::MAX_SYNC_OBJ) return -1;
+		Dependency* deps = new Dependency[count];
+		size_t kept = 0;
+		for(uint64_t j = 0; j < count; j++) {
+			dep_dump_entry entry;
+			if(!readAll(file, &entry, sizeof(entry))) return -1;
+			if(entry.holdingCount < 0 || entry.holdingCount > xdefines::MAX_HOLDING_DEPTH
+				|| entry.callsiteCount < 0 || entry.callsiteCount > xdefines::CALLSITE_UNIQUE_MAX
+				|| entry.holdingCallsiteCount < 0 || entry.holdingCallsiteCount > xdefines::HOLDING_CALLSITE_MAX
+				|| entry.initFound > xdefines::MAX_STACK_DEPTH) return -1;
+			Dependency* dep = &deps[kept];
+			if(!readAll(file, dep->callerAddr, entry.callsiteCount * sizeof(dep->callerAddr[0]))) return -1;
+			bool special = isSpecialLock(entry.lock);
+			for(int k = 0; k < entry.holdingCount; k++) special |= isSpecialLock(entry.holdingSet[k]);
+			if(stale && special) {
+				dropped++;
+				continue;
+			}
+			my_mutex* real = NULL;
+			if(entry.hasRealLock) {
+				map<void*, my_mutex*>::iterator iter = realLocks.find(entry.lock);
+				if(iter != realLocks.end()) {
+					real = iter->second;
+				} else {
+					real = new my_mutex();
+					real->callsite = NULL;
+					real->specialSlot = stale ? -1 : entry.specialSlot;
+					if(entry.initFound >= 0) {
+						real->callsite = new callstack();
+						real->callsite->found = entry.initFound;
+						memcpy(real->callsite->stack, entry.initStack, sizeof(entry.initStack));
+					}
+					realLocks[entry.lock] = real;
+				}
+			}
+			dep->update(entry.lock, real, entry.holdingSet, entry.holdingCount);
+			dep->condRelated = entry.condRelated;
+			dep->callsiteCount = entry.callsiteCount;
+			dep->holdingCallsiteCount = entry.holdingCallsiteCount;
+			memcpy(dep->holdingCallerAddr, entry.holdingCallerAddr, sizeof(entry.holdingCallerAddr));
+			memcpy(dep->holdingCallerIndex, entry.holdingCallerIndex, sizeof(entry.holdingCallerIndex));
+			kept++;
+		}
+		threadsInfoReal[i].dependencies = deps;
+		threadsInfoReal[i].depCount = kept;
+	}
+	if(dropped > 0) {
+		fprintf(stderr, "The history file changed since the process loaded it, %zu dependencies on its merge sets are dropped\n", dropped);
+	}
+	return header.records;
+}
+
+// dependencies of a traced thread, as updateDependency() records them
+struct replay_thread {
+	vector<void*> holding;
+	vector<void*> holdingSite;
+	vector<Dependency> deps;
+	map<string, size_t> index; // lock and holding set -> dependency
+};
+
+static string getDependencyKey(void* lock, void** holding, int count) {
+	string key((char*)&lock, sizeof(void*));
+	key.append((char*)holding, count * sizeof(void*));
+	return key;
+}
+
+// locks named in history without call stacks are found by their addresses,
+// they stand for the shared locks of their merge sets as in the process
+static void getHistoryLocks(map<void*, void*>* historyLocks) {
+	int setIndex = 0;
+	for(special_info_list* sll = prevention::getInstance().specialList->next; sll != NULL; sll = sll->next, setIndex++) {
+		void* shared = (void*)(ADDITIONAL_LOCK_STARTADDR + (uintptr_t)mutexUnit * setIndex);
+		for(auto si = sll->list->next; si != NULL; si = si->next) {
+			special_info* info = si->entry;
+			if(info->callsite->found == 0 && info->acqsite == NULL) (*historyLocks)[info->lock] = shared;
+		}
+	}
+}
+
+static void replayLock(replay_thread* thread, void* lock, void* site, size_t* overflow) {
+	int hc = thread->holding.size();
+	if(hc > 0 && hc <= xdefines::MAX_HOLDING_DEPTH) {
+		void** holding = &thread->holding[0];
+		string key = getDependencyKey(lock, holding, hc);
+		map<string, size_t>::iterator iter = thread->index.find(key);
+		size_t d;
+		if(iter == thread->index.end()) {
+			d = thread->deps.size();
+			thread->deps.push_back(Dependency(lock, NULL, holding, hc));
+			thread->index[key] = d;
+		} else {
+			d = iter->second;
+		}
+		Dependency* dep = &thread->deps[d];
+		dep->addNewCallsite(site, NULL);
+		for(int i = 0; i < hc; i++) dep->addHoldingCallsite(i, thread->holdingSite[i]);
+	} else if(hc > xdefines::MAX_HOLDING_DEPTH) {
+		(*overflow)++;
+	}
+	thread->holding.push_back(lock);
+	thread->holdingSite.push_back(site);
+}
+
+static void replayUnlock(replay_thread* thread, void* lock) {
+	for(int i = thread->holding.size() - 1; i >= 0; i--) {
+		if(thread->holding[i] == lock) {
+			thread->holding.erase(thread->holding.begin() + i);
+			thread->holdingSite.erase(thread->holdingSite.begin() + i);
+			return;
+		}
+	}
+}
+
+// as updateDependencyWithCond()
+static void replayCondWait(replay_thread* thread, void* lock) {
+	int hc = thread->holding.size();
+	for(int i = hc - 1; i > 0 && i <= xdefines::MAX_HOLDING_DEPTH; i--) {
+		map<string, size_t>::iterator iter = thread->index.find(getDependencyKey(thread->holding[i], &thread->holding[0], i));
+		if(iter != thread->index.end()) thread->deps[iter->second].condRelated = true;
+		if(thread->holding[i] == lock) break;
+	}
+}
+
+/*
+ * A trace is replayed thread by thread, in the order of its events. Acquisition call sites
+ * only have the 1st level, and locks have no init call stacks.
+ */
+static int loadTrace(FILE* file, const char* filename, int* pid) {
+	trace_header header;
+	if(!readAll(file, &header, sizeof(header)) || header.version != xdefines::TRACE_VERSION || header.eventSize != sizeof(trace_event)) {
+		fprintf(stderr, "Unknown trace version\n");
+		return -1;
+	}
+	*pid = header.pid;
+	// the trace is <program>_<pid>.trace unless the program is given
+	if(programPath.empty()) {
+		char suffix[32];
+		snprintf(suffix, sizeof(suffix), "_%d%s", header.pid, TRACE_FILE);
+		string name = filename;
+		if(name.size() <= strlen(suffix) || name.compare(name.size() - strlen(suffix), string::npos, suffix) != 0) {
+			fprintf(stderr, "Cannot tell the program from %s, give it with -p\n", filename);
+			return -1;
+		}
+		name.erase(name.size() - strlen(suffix));
+		setProgram(name);
+	} else {
+		setProgram(programPath);
+	}
+	if(header.events == 0) fprintf(stderr, "The trace was not completed, replaying the events written\n");
+	map<void*, void*> historyLocks;
+	getHistoryLocks(&historyLocks);
+	map<int, replay_thread> threads;
+	vector<int> order; // tids by their 1st event
+	size_t events = 0;
+	size_t overflow = 0;
+	trace_event buf[1024];
+	size_t n;
+	while((n = fread(buf, sizeof(trace_event), 1024, file)) > 0) {
+		for(size_t e = 0; e < n; e++) {
+			trace_event* event = &buf[e];
+			if(threads.find(event->tid) == threads.end()) order.push_back(event->tid);
+			replay_thread* thread = &threads[event->tid];
+			void* lock = event->lock;
+			map<void*, void*>::iterator iter = historyLocks.find(lock);
+			if(iter != historyLocks.end()) lock = iter->second;
+			switch(event->type) {
+			case TRACE_LOCK:
+				replayLock(thread, lock, event->site, &overflow);
+				break;
+			case TRACE_TRYLOCK:
+				thread->holding.push_back(lock);
+				thread->holdingSite.push_back(event->site);
+				break;
+			case TRACE_UNLOCK:
+				replayUnlock(thread, lock);
+				break;
+			case TRACE_COND_WAIT:
+				replayCondWait(thread, lock);
+				break;
+			default: // the lock is still in the holding set on wake
+				break;
+			}
+		}
+		events += n;
+	}
+	if(order.size() > xdefines::MAX_THREADS) {
+		fprintf(stderr, "Too many threads in the trace: %zu\n", order.size());
+		return -1;
+	}
+	fprintf(stderr, "Replayed %zu events of %zu threads", events, order.size());
+	if(header.dropped > 0) fprintf(stderr, ", %lu events were dropped while tracing", (unsigned long)header.dropped);
+	fprintf(stderr, "\n");
+	if(overflow > 0) fprintf(stderr, "%zu acquisitions deeper than %d locks are not recorded\n", overflow, xdefines::MAX_HOLDING_DEPTH);
+	for(size_t i = 0; i < order.size(); i++) {
+		replay_thread* thread = &threads[order[i]];
+		// kept until exit
+		Dependency* deps = new Dependency[thread->deps.size()];
+		for(size_t d = 0; d < thread->deps.size(); d++) deps[d] = thread->deps[d];
+		threadsInfoReal[i].dependencies = deps;
+		threadsInfoReal[i].depCount = thread->deps.size();
+	}
+	return order.size();
+}
+
+static void usage(const char* prog) {
+	fprintf(stderr, "Usage: %s [-p program] <program_pid.deps | program_pid.trace>\n", prog);
+	fprintf(stderr, "  -p : path of the program, if it is not where the file was written\n");
+	exit(1);
+}
+
+int main(int argc, char** argv) {
+	int arg = 1;
+	if(arg + 1 < argc && strcmp(argv[arg], "-p") == 0) {
+		programPath = argv[arg + 1];
+		arg += 2;
+	}
+	if(arg + 1 != argc) usage(argv[0]);
+	const char* filename = argv[arg];
+
+	threadsInfo = new thread_t[xdefines::MAX_THREADS];
+	threadsInfoReal = new real_thread_t[xdefines::MAX_THREADS];
+	mutexUnit = 64 * (sizeof(pthread_mutex_t) / 64 + 1);
+	realMutexStart = realMutexEnd = NULL;
+
+	FILE* file = fopen(filename, "r");
+	if(file == NULL) {
+		fprintf(stderr, "Cannot open %s: %s\n", filename, strerror(errno));
+		return 1;
+	}
+	uint32_t magic = 0;
+	if(!readAll(file, &magic, sizeof(magic)) || fseek(file, 0, SEEK_SET) != 0) magic = 0;
+	int pid = 0;
+	int amount = -1;
+	if(magic == xdefines::DEP_DUMP_MAGIC) {
+		amount = loadDump(file, &pid);
+	} else if(magic == xdefines::TRACE_MAGIC) {
+		amount = loadTrace(file, filename, &pid);
+	} else {
+		fprintf(stderr, "%s is neither a dependency dump nor a trace\n", filename);
+	}
+	fclose(file);
+	if(amount < 0) {
+		fprintf(stderr, "Failed to read %s\n", filename);
+		return 1;
+	}
+
+	analyzer::getInstance().initialize();
+	analyzer::getInstance().setPid(pid);
+	fprintf(stderr, "start analyzing..\n");
+	analyzer::getInstance().finalize(amount);
+	return 0;
+}
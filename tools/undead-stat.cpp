@@ -0,0 +1,128 @@
+/* Copyright (C)
+* 2017 - Jinpeng Zhou, Jinpeng.Zhou@utsa.edu
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU General Public License
+* as published by the Free Software Foundation; either version 2
+* of the License, or (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; if not, write to the Free Software
+* Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*
+*/
+/**
+* @file undead-stat.cpp
+* @brief Print the live statistics of a process running with UnDead built with -DLIVE_STATS.
+* @author Jinpeng Zhou, Jinpeng.Zhou@utsa.edu
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#include "livestats.hh"
+
+#define COUNTERS 9
+
+static const char* counterNames[COUNTERS] = {
+	"lock", "trylock", "unlock", "nested", "newdep", "backtrace", "sitehit", "probe", "redirect"
+};
+
+// counters are written by the threads of the process at any time, read each one once
+static void readCounters(volatile thread_stats* stats, uint64_t* counters) {
+	counters[0] = stats->lockCalls;
+	counters[1] = stats->trylockCalls;
+	counters[2] = stats->unlockCalls;
+	counters[3] = stats->nestedAcquisitions;
+	counters[4] = stats->newDependencies;
+	counters[5] = stats->backtraces;
+	counters[6] = stats->callsiteHits;
+	counters[7] = stats->hashProbes;
+	counters[8] = stats->redirectedAcquisitions;
+}
+
+static void printHeader(const char* first) {
+	printf("%8s %7s", first, "tid");
+	for(int c = 0; c < COUNTERS; c++) printf(" %12s", counterNames[c]);
+	printf("\n");
+}
+
+static void printCounters(uint64_t* counters) {
+	for(int c = 0; c < COUNTERS; c++) printf(" %12lu", (unsigned long)counters[c]);
+	printf("\n");
+}
+
+// one table of every thread record used so far, the total last
+static void printStats(live_stats_header* header, bool all) {
+	thread_stats* stats = (thread_stats*)(header + 1);
+	uint64_t total[COUNTERS] = {0};
+	printHeader("record");
+	for(uint32_t i = 0; i < header->capacity; i++) {
+		volatile thread_stats* st = &stats[i];
+		if(st->tid == 0) continue; // never used
+		uint64_t counters[COUNTERS];
+		readCounters(st, counters);
+		for(int c = 0; c < COUNTERS; c++) total[c] += counters[c];
+		if(!st->active && !all) continue;
+		printf("%7u%c %7d", i, st->active ? ' ' : '*', st->tid);
+		printCounters(counters);
+	}
+	printf("%8s %7s", "total", "");
+	printCounters(total);
+}
+
+static void usage(const char* prog) {
+	fprintf(stderr, "Usage: %s [-a] <pid> [interval secs]\n", prog);
+	fprintf(stderr, "  -a : also print the records of joined threads, marked by *\n");
+	exit(1);
+}
+
+int main(int argc, char** argv) {
+	bool all = false;
+	int arg = 1;
+	if(arg < argc && strcmp(argv[arg], "-a") == 0) {
+		all = true;
+		arg++;
+	}
+	if(arg >= argc) usage(argv[0]);
+	int pid = atoi(argv[arg++]);
+	int interval = arg < argc ? atoi(argv[arg]) : 0;
+	if(pid <= 0 || interval < 0) usage(argv[0]);
+
+	char name[64];
+	snprintf(name, sizeof(name), LIVE_STATS_NAME, pid);
+	int fd = shm_open(name, O_RDONLY, 0);
+	if(fd < 0) {
+		fprintf(stderr, "Cannot open /dev/shm%s, is process %d running with -DLIVE_STATS?\n", name, pid);
+		return 1;
+	}
+	struct stat st;
+	if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(live_stats_header)) {
+		fprintf(stderr, "Invalid segment /dev/shm%s\n", name);
+		return 1;
+	}
+	live_stats_header* header = (live_stats_header*)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(header == MAP_FAILED) {
+		fprintf(stderr, "Cannot map /dev/shm%s\n", name);
+		return 1;
+	}
+	if(__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != LIVE_STATS_MAGIC || header->version != LIVE_STATS_VERSION
+		|| sizeof(live_stats_header) + header->capacity * sizeof(thread_stats) > (size_t)st.st_size) {
+		fprintf(stderr, "Unknown layout of /dev/shm%s\n", name);
+		return 1;
+	}
+
+	while(true) {
+		printStats(header, all);
+		if(interval == 0) break;
+		sleep(interval);
+		printf("\n");
+	}
+	munmap(header, st.st_size);
+	return 0;
+}
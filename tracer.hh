@@ -0,0 +1,242 @@
+/* Copyright (C)
+* 2017 - Jinpeng Zhou, Jinpeng.Zhou@utsa.edu
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU General Public License
+* as published by the Free Software Foundation; either version 2
+* of the License, or (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; if not, write to the Free Software
+* Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*
+*/
+/**
+* @file tracer.hh
+* @brief Per-thread rings of lock events, streamed into a binary trace file.
+* @author Jinpeng Zhou, Jinpeng.Zhou@utsa.edu
+*/
+#ifndef __TRACER_HH__
+#define __TRACER_HH__
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <string>
+
+#include "xdefines.hh"
+
+#define TRACE_FILE ".trace"
+
+enum trace_type {
+	TRACE_LOCK = 1, // acquired
+	TRACE_TRYLOCK, // acquired by a trylock
+	TRACE_UNLOCK, // about to be released
+	TRACE_COND_WAIT, // released by a cond wait
+	TRACE_COND_WAKE // acquired again when the cond wait returns
+};
+
+// the call site is the return address of the interposed call
+struct trace_event {
+	uint64_t ticks;
+	void* lock;
+	void* site;
+	int32_t tid;
+	int32_t type;
+};
+
+// the file starts with it, then events follow, ordered by time within a thread only
+struct trace_header {
+	uint32_t magic;
+	uint32_t version;
+	int32_t pid;
+	uint32_t eventSize;
+	uint64_t events;
+	uint64_t dropped; // by full rings
+	// to turn ticks into time
+	uint64_t startTicks;
+	uint64_t startNanos;
+	uint64_t endTicks;
+	uint64_t endNanos;
+};
+
+// a single producer, the thread using the record, and a single consumer, the flusher
+struct trace_ring {
+	// written by the producer
+	size_t head __attribute__((aligned(64)));
+	size_t cachedTail; // last tail seen, reloaded only when the ring looks full
+	size_t dropped;
+	int32_t tid;
+	// written by the flusher
+	size_t tail __attribute__((aligned(64)));
+	trace_event events[xdefines::TRACE_RING_EVENTS] __attribute__((aligned(64)));
+};
+
+// a full ring drops the event, the thread never waits for the flusher
+INLINE void traceEvent(trace_ring* ring, int type, void* lock, void* site) {
+	size_t head = ring->head;
+	if(head - ring->cachedTail >= xdefines::TRACE_RING_EVENTS) {
+		ring->cachedTail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+		if(head - ring->cachedTail >= xdefines::TRACE_RING_EVENTS) {
+			ring->dropped++;
+			return;
+		}
+	}
+	trace_event* event = &ring->events[head & (xdefines::TRACE_RING_EVENTS - 1)];
+	event->ticks = getTicks();
+	event->lock = lock;
+	event->site = site;
+	event->tid = ring->tid;
+	event->type = type;
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * The flusher thread wakes every TRACE_FLUSH_US, and copies new events of every ring into
+ * the trace file, which is grown and mapped one segment at a time.
+ * The header is completed at exit.
+ */
+class tracer {
+private:
+	tracer() { }
+
+public:
+	static tracer& getInstance() {
+		static char buf[sizeof(tracer)];
+		static tracer* theOneTrueObject = new (buf) tracer();
+		return *theOneTrueObject;
+	}
+
+	void initialize(const char* filename) {
+		memset(_rings, 0, sizeof(_rings));
+		_segment = NULL;
+		_segmentIndex = 0;
+		_written = sizeof(trace_header);
+		_stop = false;
+		_fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if(_fd < 0 || !mapSegment(0)) {
+			fprintf(stderr, "Failed to create trace file %s\n", filename);
+			if(_fd >= 0) close(_fd);
+			_fd = -1;
+		}
+		trace_header* header = (trace_header*)_segment;
+		if(header != NULL) {
+			header->magic = xdefines::TRACE_MAGIC;
+			header->version = xdefines::TRACE_VERSION;
+			header->pid = getpid();
+			header->eventSize = sizeof(trace_event);
+			header->startTicks = getTicks();
+			header->startNanos = getNanos();
+		}
+		// events are still recorded without a file, and dropped once the rings are full
+		if(_fd >= 0) WRAP(pthread_create)(&_flusher, NULL, flusherThread, NULL);
+	}
+
+	// the record keeps its ring when it is reused
+	trace_ring* getRing(int index, int tid) {
+		trace_ring* ring = _rings[index];
+		if(ring == NULL) {
+			ring = (trace_ring*)MM::mmapAllocatePrivate(sizeof(trace_ring));
+			__atomic_store_n(&_rings[index], ring, __ATOMIC_RELEASE);
+		}
+		ring->tid = tid;
+		return ring;
+	}
+
+	// stop the flusher, write what is left and complete the header
+	void finalize() {
+		if(_fd < 0) return;
+		__atomic_store_n(&_stop, true, __ATOMIC_RELEASE);
+		WRAP(pthread_join)(_flusher, NULL);
+		flush();
+		size_t dropped = 0;
+		for(int i = 0; i < xdefines::MAX_THREADS; i++) {
+			if(_rings[i] != NULL) dropped += _rings[i]->dropped;
+		}
+		if(_segment != NULL) munmap(_segment, xdefines::TRACE_SEGMENT_SIZE);
+		trace_header header;
+		if(pread(_fd, &header, sizeof(header), 0) == sizeof(header)) {
+			header.events = (_written - sizeof(trace_header)) / sizeof(trace_event);
+			header.dropped = dropped;
+			header.endTicks = getTicks();
+			header.endNanos = getNanos();
+			if(pwrite(_fd, &header, sizeof(header), 0) != sizeof(header)) fprintf(stderr, "Failed to write the trace header\n");
+		}
+		if(ftruncate(_fd, _written) != 0) fprintf(stderr, "Failed to truncate the trace file\n");
+		close(_fd);
+		if(dropped > 0) fprintf(stderr, "Trace: %zu events dropped by full rings\n", dropped);
+	}
+
+private:
+	static void* flusherThread(void*) {
+		tracer& instance = getInstance();
+		while(!__atomic_load_n(&instance._stop, __ATOMIC_ACQUIRE)) {
+			usleep(xdefines::TRACE_FLUSH_US);
+			instance.flush();
+		}
+		return NULL;
+	}
+
+	void flush() {
+		for(int i = 0; i < xdefines::MAX_THREADS; i++) {
+			trace_ring* ring = __atomic_load_n(&_rings[i], __ATOMIC_ACQUIRE);
+			if(ring == NULL) continue;
+			size_t tail = ring->tail;
+			size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+			while(tail < head) {
+				size_t start = tail & (xdefines::TRACE_RING_EVENTS - 1);
+				size_t count = head - tail;
+				if(count > xdefines::TRACE_RING_EVENTS - start) count = xdefines::TRACE_RING_EVENTS - start;
+				if(!append(&ring->events[start], count * sizeof(trace_event))) return;
+				tail += count;
+			}
+			// the producer may reuse the slots now
+			__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+		}
+	}
+
+	// copy into the mapped segment, moving to the next one when it is full
+	bool append(void* data, size_t size) {
+		while(size > 0) {
+			if(_segment == NULL) return false;
+			size_t offset = _written - _segmentIndex * xdefines::TRACE_SEGMENT_SIZE;
+			if(offset == xdefines::TRACE_SEGMENT_SIZE) {
+				munmap(_segment, xdefines::TRACE_SEGMENT_SIZE);
+				if(!mapSegment(_segmentIndex + 1)) return false;
+				offset = 0;
+			}
+			size_t length = xdefines::TRACE_SEGMENT_SIZE - offset;
+			if(length > size) length = size;
+			memcpy((char*)_segment + offset, data, length);
+			data = (char*)data + length;
+			size -= length;
+			_written += length;
+		}
+		return true;
+	}
+
+	bool mapSegment(size_t index) {
+		if(ftruncate(_fd, (index + 1) * xdefines::TRACE_SEGMENT_SIZE) != 0) return false;
+		void* ptr = mmap(NULL, xdefines::TRACE_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, index * xdefines::TRACE_SEGMENT_SIZE);
+		if(ptr == MAP_FAILED) {
+			_segment = NULL;
+			return false;
+		}
+		_segment = ptr;
+		_segmentIndex = index;
+		return true;
+	}
+
+	trace_ring* _rings[xdefines::MAX_THREADS]; // by thread index
+	pthread_t _flusher;
+	bool _stop;
+	int _fd;
+	void* _segment; // mapped part of the file
+	size_t _segmentIndex;
+	size_t _written; // bytes of the file
+};
+#endif
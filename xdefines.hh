@@ -29,8 +29,11 @@
 #include <pthread.h>
 #include <signal.h>
 #include <set>
+#include <vector>
 #include <fstream>
 #include <unistd.h>
+#include <time.h>
+#include <sys/syscall.h>
 
 #include "libfuncs.hh"
 #include "hashmap.hh"
@@ -61,6 +64,17 @@ using namespace std;
     return (a > b ? a : b);
   }
 
+  inline uint64_t getNanos() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+  }
+
+  // time stamp counter, cheaper than getNanos() on the acquisition path
+  inline uint64_t getTicks() {
+    return __builtin_ia32_rdtsc();
+  }
+
 class xdefines {
 public:
   enum { MAX_THREADS = 1024 };
@@ -77,14 +91,92 @@ public:
 	// for acquisition
 	enum { CALLSITE_LEVEL = 2};
 	enum { CALLSITE_UNIQUE_MAX = 1024};
+	enum { HOLDING_CALLSITE_MAX = 16}; // call sites of held locks per dependency
 	enum { ACQ_CALLSTACK_DEPTH = CALLSITE_LEVEL + 1};
+	enum { ACQ_MISS_CACHE = 4096 }; // pristine mutexes remembered as not recorded, a power of 2
+
+	// for matching init call stacks in prevention
+	enum { CALLSITE_TREE_FANOUT = 4 }; // initial children table size of a tree node
+	enum { CALLSITE_BLOOM_BITS = 1024 };
+
+	// for ordered prevention, larger merge sets fall back to a shared lock
+	enum { ORDER_SET_MAX = 64 };
+
+	// for avoidance, how a thread is parked before it gives up and acquires anyway.
+	// The thread holding a closing member may wait for one held outside the set.
+	enum { AVOIDANCE_YIELDS = 64 };
+	enum { AVOIDANCE_SLEEP_US = 50 };
+	enum { AVOIDANCE_PARK_MAX_US = 100000 };
+
+	// for hot reload, merge sets and member slots are allocated up front and never moved
+	enum { RELOAD_SET_CAPACITY = 256 };
+	enum { RELOAD_SLOT_CAPACITY = 2048 };
+
+	// for the journal of cycles found during execution
+	enum { JOURNAL_MAGIC = 0x4a444e55 };
+	enum { JOURNAL_CYCLE_MAX = 8 }; // locks in one journaled cycle
+	enum { JOURNAL_SITE_MAX = 4 }; // acquisition call sites of one journaled lock
+
+	// for lock classes, power of 2 sizes
+	enum { LOCK_CLASS_MAX = 65536 }; // call sites
+	enum { LOCK_CLASS_MAP_SIZE = 4194304 }; // locks
+	enum { LOCK_CLASS_PROBE_MAX = 64 };
+
+	// for lock profiling, power of 2 table size
+	enum { LOCK_PROFILE_MAP_SIZE = 16384 };
+	enum { LOCK_PROFILE_PROBE_MAX = 64 };
+	enum { LOCK_PROFILE_BUCKETS = 40 }; // log2 of ticks, the last one takes longer ones too
+	enum { LOCK_PROFILE_SITE_MAX = 8 }; // acquisition call sites of one lock
+	enum { LOCK_PROFILE_TOP = 10 }; // locks in each ranking
+
+	// for tracing, power of 2 ring size
+	enum { TRACE_MAGIC = 0x52544e55 };
+	enum { TRACE_VERSION = 1 };
+	enum { TRACE_RING_EVENTS = 4096 }; // events per thread not yet flushed
+	enum { TRACE_FLUSH_US = 1000 }; // period of the flusher thread
+	enum { TRACE_SEGMENT_SIZE = 0x400000 }; // the trace file is mapped by segments
+
+	// for the dependency dump
+	enum { DEP_DUMP_MAGIC = 0x50444e55 };
+	enum { DEP_DUMP_VERSION = 1 };
 
 	enum { MONITOR_PERIOD = 2 }; // monitor thread period (secs)
+	enum { BLOCK_THRESHOLD_MS = 10 }; // an acquisition blocked longer wakes the event-driven monitor thread
+	enum { DETECT_SLICE_MS = 20 }; // time slice of one periodic detection pass on the monitor thread
+	enum { DETECT_CLOCK_STEPS = 256 }; // search steps between checks of the time slice
+	enum { SNAPSHOT_RETRY_MAX = 64 }; // reads of a thread's holdings while it keeps changing them
 	enum { MONITOR_THRESHOLD = 10 }; // threadshold about when to treat it as a hung, and exit 
+	enum { ANALYSIS_TIMEOUT_S = 600 }; // lifetime of the process analyzing at exit, with -DFORK_ANALYSIS
 };
 
+// called on the monitor thread with the victim of a deadlock and the lock it blocks on.
+// Nonzero if the application takes care of the victim, otherwise its acquisition fails with EDEADLK.
+typedef int (*recovery_handler)(pthread_t victim, void* lock);
+
 #define MAXBUFSIZE 1024
 #define DEADLOCK_FILE "_deadlock.info"
+#define DEADLOCK_JOURNAL "_deadlock.journal"
+#define ANALYSIS_FILE ".analysis" // output of the analysis forked at exit
+
+// members of a merge set keep their own mutexes, instead of a shared lock
+#if defined(ORDERED_PREVENTION) || defined(CALLSITE_GATE) || defined(ENABLE_AVOIDANCE)
+#define KEEP_MEMBER_MUTEX
+#endif
+
+// the event-driven monitor thread and recovery work on the wait-for graph
+#if (defined(EVENT_MONITOR) || defined(DEADLOCK_RECOVERY)) && !defined(WAIT_FOR_GRAPH)
+#define WAIT_FOR_GRAPH
+#endif
+
+// SIGUSR2 asks the monitor thread for a report, the program keeps running
+#if defined(USING_SIGUSR2) && defined(MONITOR_THREAD) && defined(ENABLE_ANALYZER) && !defined(RUNTIME_OVERHEAD)
+#define ON_DEMAND_REPORT
+#endif
+
+// the monitor thread sleeps on an eventfd, which also stops it at exit
+#if defined(EVENT_MONITOR) || (defined(MONITOR_THREAD) && defined(ENABLE_ANALYZER) && !defined(RUNTIME_OVERHEAD))
+#define MONITOR_EVENTFD
+#endif
 
 #define ADDITIONAL_LOCK_STARTADDR 0x12340C000000
 #define INDIRECTION_MASK ADDITIONAL_LOCK_STARTADDR
@@ -100,35 +192,181 @@ struct callstack {
 	char align[8];
 };
 
+/*
+ * Acquisition call site of a lock, as in Dependency::callerAddr
+ */
+struct acq_callsite {
+	acq_callsite(void* addr_1 = NULL, void* addr_2 = NULL, void* real = NULL, int slot = -1) : realMutex(real), specialSlot(slot), next(NULL), hashNext(NULL) {
+		addr[0] = addr_1;
+		addr[1] = addr_2;
+	}
+	void* addr[xdefines::CALLSITE_LEVEL];
+	void* realMutex; // the shared lock to redirect to
+	int specialSlot; // member slot of the lock in its merge set
+	acq_callsite* next; // next call site of the same lock
+	acq_callsite* hashNext; // next call site in the same hash bucket
+
+	static INLINE void* getKey(void* addr_1, void* addr_2) {
+		return (void*)(((uintptr_t)addr_1 * 0x9E3779B97F4A7C15UL) ^ (uintptr_t)addr_2);
+	}
+};
+
+typedef HashMap<void*, acq_callsite*, HeapAllocator> AcqCallsiteHashMap;
+
 /*
  * For sets in history file
  */
 struct special_info {
-	special_info (void* l = NULL, callstack *cs = NULL) : lock(l), callsite(cs) {}
+	special_info (void* l = NULL, callstack *cs = NULL, int slot = -1) : lock(l), callsite(cs), acqsite(NULL), specialSlot(slot) {}
 	void* lock;
 	callstack* callsite;
+	acq_callsite* acqsite; // acquisition call sites, for locks without init call stacks
+	int specialSlot; // index of per-thread special holding counter, assigned when loading history
 };
 
 struct special_info_list : public EntryList<special_info> {
-	special_info_list() : next(NULL) {}
+	special_info_list() : next(NULL), count(0), written(false) {}
 	special_info_list* next;
+	int count; // how many locks in this set
+	vector<pair<int, int> > edges; // (held, acquired) member indexes recorded inside this set
+	vector<void*> gateSites; // sorted call sites of the acquisitions that form the cycles
+	bool written; // already written into a new merge set
+};
+
+/*
+ * Contention of a special lock, for PREVENTION_STATS
+ * only the holder of the special lock updates it, except mapped
+ */
+struct special_stats {
+	size_t acquisitions;
+	size_t contended; // acquisitions that had to wait
+	uint64_t waitNanos;
+	uint64_t holdNanos;
+	uint64_t holdStart; // when the current holder acquired it
+	size_t mapped; // original mutexes redirected to it
+	char align[16];
+};
+
+/*
+ * Acquisition order of a member inside its merge set, for ORDERED_PREVENTION
+ */
+struct order_slot {
+	order_slot() : set(-1), rank(0), ordered(false), gated(false), avoided(false), pinMask(0), closers(0), bound(NULL) {}
+	int set; // merge set index
+	int rank; // position in the acquisition order of the set
+	bool ordered; // acquired in order, for ORDERED_PREVENTION
+	bool gated; // gated at the recorded call sites only, for CALLSITE_GATE
+	bool avoided; // parked at the recorded call sites instead, for ENABLE_AVOIDANCE
+	uint64_t pinMask; // lower-ranked members reachable from this one, by rank
+	uint64_t closers; // members with a recorded edge to this one, by member index, for ENABLE_AVOIDANCE
+	pthread_mutex_t* bound; // the 1st mutex bound to this member, the only one ordered
 };
 
 /*
  * For comparing call stacks
  * each path from root to leaf is a callstack
+ * children are kept in a small open-addressing table keyed by caller address
  */
 struct callsite_tree {
 	callsite_tree(void* addr = NULL) {
-		child = NULL;
-		siblings = NULL;
 		callerAddr = addr;
+		realMutex = NULL;
+		specialSlot = -1;
+		children = NULL;
+		childCount = 0;
+		childCapacity = 0;
+	}
+
+	void* callerAddr;
+	void* realMutex; // the shared lock, when a recorded callstack ends at this node
+	int specialSlot; // member slot of the lock whose callstack ends at this node
+	callsite_tree **children;
+	int childCount;
+	int childCapacity; // always a power of 2
+
+	static INLINE size_t hashCaller(void* addr) {
+		uintptr_t h = (uintptr_t)addr;
+		h ^= h >> 17;
+		h *= 0x9E3779B97F4A7C15UL;
+		return (size_t)(h >> 32);
+	}
+
+	// find the child with the given caller address
+	INLINE callsite_tree* findChild(void* addr) {
+		if(childCount == 0) return NULL;
+		size_t mask = childCapacity - 1;
+		for(size_t i = hashCaller(addr) & mask; children[i] != NULL; i = (i + 1) & mask) {
+			if(children[i]->callerAddr == addr) return children[i];
+		}
+		return NULL;
+	}
+
+	// return the child with the given caller address, create it if absent
+	callsite_tree* addChild(void* addr) {
+		callsite_tree* node = findChild(addr);
+		if(node != NULL) return node;
+		// keep the load factor under 1/2
+		if((childCount + 1) * 2 > childCapacity) {
+			int oldCapacity = childCapacity;
+			callsite_tree** old = children;
+			childCapacity = (childCapacity == 0) ? xdefines::CALLSITE_TREE_FANOUT : childCapacity * 2;
+			children = new callsite_tree*[childCapacity]();
+			for(int i = 0; i < oldCapacity; i++) {
+				if(old[i] != NULL) placeChild(old[i]);
+			}
+			delete[] old;
+		}
+		node = new callsite_tree(addr);
+		placeChild(node);
+		childCount++;
+		return node;
 	}
 
-	// we re-use the callerAddr as the realMutex for leaves
-	void* callerAddr; // only for intermediate nodes
-	callsite_tree *child;
-	callsite_tree *siblings;
+private:
+	void placeChild(callsite_tree* node) {
+		size_t mask = childCapacity - 1;
+		size_t i = hashCaller(node->callerAddr) & mask;
+		while(children[i] != NULL) i = (i + 1) & mask;
+		children[i] = node;
+	}
+};
+
+/*
+ * Bloom filter over the first-level caller addresses of the callsite tree
+ * used to reject unrelated mutex_init call sites with one probe
+ */
+struct callsite_bloom {
+	callsite_bloom() { memset(bits, 0, sizeof(bits)); }
+
+	enum { WORDS = xdefines::CALLSITE_BLOOM_BITS / 64 };
+	uint64_t bits[WORDS];
+
+	INLINE void add(void* addr) {
+		size_t h = callsite_tree::hashCaller(addr);
+		size_t h1 = h % xdefines::CALLSITE_BLOOM_BITS;
+		size_t h2 = (h >> 16) % xdefines::CALLSITE_BLOOM_BITS;
+		bits[h1 / 64] |= 1UL << (h1 % 64);
+		bits[h2 / 64] |= 1UL << (h2 % 64);
+	}
+
+	INLINE bool mayContain(void* addr) {
+		size_t h = callsite_tree::hashCaller(addr);
+		size_t h1 = h % xdefines::CALLSITE_BLOOM_BITS;
+		size_t h2 = (h >> 16) % xdefines::CALLSITE_BLOOM_BITS;
+		return (bits[h1 / 64] & (1UL << (h1 % 64))) && (bits[h2 / 64] & (1UL << (h2 % 64)));
+	}
+};
+
+/*
+ * What init() and the 1st acquisition of a lock are matched against.
+ * Built from all merge sets, and replaced as a whole when the history is reloaded.
+ */
+struct history_index {
+	history_index() : tree(new callsite_tree()), acqAmount(0) {}
+	callsite_tree* tree; // for locks initialized by init(), the call stacks of init()
+	callsite_bloom filter; // first-level caller addresses in tree
+	AcqCallsiteHashMap acqMap; // for locks without init call stacks, the acquisition call sites
+	int acqAmount;
 };
 
 /*
@@ -152,46 +390,8 @@ struct deadlock_info {
 struct my_mutex{
 	pthread_mutex_t myMutex;
 	callstack* callsite;
-	char align[16];
-};
-
-/*
- * Handle counter for each special lock in a merge set.
- */
-struct special_lock_list {
-	special_lock_list(void* l = NULL) : lock(l), count(1) { }
-	void* lock;
-	int count;
-};
-
-struct special_holding : public EntryList<special_lock_list> {
-	special_holding() : count(0) { }
-
-	int count;
-
-	void updateByLock(void* lock) {
-		for(auto sll = list->next; sll != NULL; sll = sll->next) {
-			if(sll->entry->lock == lock) {
-				sll->entry->count++;
-				count++;
-				return;
-			}
-		}
-		insertToTail(new special_lock_list(lock));
-		count++;
-	}
-
-	void updateByUnLock(void* lock) {
-		for(auto sll = list->next; sll != NULL; sll = sll->next) {
-			if(sll->entry->lock == lock) {
-				if(sll->entry->count > 0) {
-					sll->entry->count--;
-					if(count > 0) count--;
-				}
-				return;
-			}
-		}
-	}
+	int specialSlot; // member slot in the merge set, for a redirected mutex
+	char align[12];
 };
 
 /*
@@ -204,6 +404,7 @@ struct Dependency {
 		holdingCount = len;
 		for(int i = 0; i < len; i++) holdingSet[i] = hs[i];
 		callsiteCount = 0;
+		holdingCallsiteCount = 0;
 	}
 	void* lock;
 	void* holdingSet[xdefines::MAX_HOLDING_DEPTH];
@@ -212,6 +413,11 @@ struct Dependency {
 	void* callerAddr[xdefines::CALLSITE_UNIQUE_MAX][xdefines::CALLSITE_LEVEL];
 	int callsiteCount;
 
+	// where the held locks were acquired, holdingCallerIndex is the index in holdingSet
+	void* holdingCallerAddr[xdefines::HOLDING_CALLSITE_MAX];
+	int holdingCallerIndex[xdefines::HOLDING_CALLSITE_MAX];
+	int holdingCallsiteCount;
+
 #ifdef ENABLE_PREVENTION
 	Dependency(void* l, void* real, void** hs, int len, bool cr = false) {
 		lock = l;
@@ -219,6 +425,8 @@ struct Dependency {
 		holdingCount = len;
 		condRelated = cr;
 		for(int i = 0; i < len; i++) holdingSet[i] = hs[i];
+		callsiteCount = 0;
+		holdingCallsiteCount = 0;
 	}
 	void* realLock;
 	bool	condRelated;
@@ -243,11 +451,23 @@ struct Dependency {
 			if(callerAddr[i][0] == addr_1 && callerAddr[i][1] == addr_2) return;
 			i++;
 		}
-		//assert(i < xdefines::CALLSITE_UNIQUE_MAX);
+		if(i >= xdefines::CALLSITE_UNIQUE_MAX) return;
 		callerAddr[i][0] = addr_1;
 		callerAddr[i][1] = addr_2;
 		callsiteCount++;
 	}
+
+	void addHoldingCallsite(int index, void* addr) {
+		int i = 0;
+		while(i < holdingCallsiteCount) {
+			if(holdingCallerIndex[i] == index && holdingCallerAddr[i] == addr) return;
+			i++;
+		}
+		if(i >= xdefines::HOLDING_CALLSITE_MAX) return;
+		holdingCallerIndex[i] = index;
+		holdingCallerAddr[i] = addr;
+		holdingCallsiteCount++;
+	}
 };
 
 /*
@@ -308,11 +528,12 @@ struct ChainStack {
 };
 
 struct OffsetInfo {
-	OffsetInfo(uintptr_t o = 0, void* l = NULL, uintptr_t rn = 0) : offset(o), lock(l), redirect(rn) {}
+	OffsetInfo(uintptr_t o = 0, void* l = NULL, uintptr_t rn = 0, int slot = -1) : offset(o), lock(l), redirect(rn), specialSlot(slot) {}
 	uintptr_t offset;
 	void* lock;
 
 	uintptr_t redirect;
+	int specialSlot;
 };
 
 struct OffsetInfoList : public EntryList<OffsetInfo> {
@@ -323,10 +544,11 @@ struct OffsetInfoList : public EntryList<OffsetInfo> {
 		return false;
 	}
 
-	bool hasEntry(uintptr_t offset, void* lock, uintptr_t* r) {
+	bool hasEntry(uintptr_t offset, void* lock, uintptr_t* r, int* slot) {
 		for(auto iter = list->next; iter!= NULL; iter = iter->next) {
 			if(iter->entry->offset == offset && iter->entry->lock == lock) {
 				*r = iter->entry->redirect;
+				*slot = iter->entry->specialSlot;
 				return true;
 			}
 		}
@@ -26,10 +26,18 @@
 
 #include "threadstruct.hh"
 #include "selfmap.hh"
+#include "threadregistry.hh"
+#ifdef MONITOR_EVENTFD
+#include <poll.h>
+#include <sys/eventfd.h>
+#endif
 
 #ifdef ENABLE_ANALYZER
 #include "analyzer.hh"
 #endif
+#ifdef DUMP_DEPENDENCIES
+#include "depdump.hh"
+#endif
 #ifdef EBANBLE_PREVENTION
 #include "prevention.hh"
 #endif
@@ -39,6 +47,21 @@ extern uintptr_t globalStackAddr;
 extern volatile int aliveThreads;
 extern bool isSingleThread;
 extern void* textTop;
+#ifdef MONITOR_EVENTFD
+extern int monitorEvent;
+#endif
+#ifdef ON_DEMAND_REPORT
+extern bool reportRequested;
+#endif
+#if defined(ENABLE_TRACE) || defined(DUMP_DEPENDENCIES) || defined(FORK_ANALYSIS)
+extern char *__progname_full;
+#endif
+#ifdef FORK_ANALYSIS
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <limits.h>
+#endif
 
 class xthread {
 private:
@@ -55,19 +78,52 @@ public:
 	void initialize() {
 #ifdef ENABLE_ANALYZER
 		analyzer::getInstance().initialize();
+#endif
+#ifdef ONLINE_DETECTION
+		lockgraph::getInstance().initialize();
+#endif
+#ifdef LOCK_CLASS
+		lockclass::getInstance().initialize();
 #endif
 		WRAP(pthread_mutex_init)(&_gMutex, NULL);
+#ifdef LIVE_STATS
+		livestats::getInstance().initialize(xdefines::MAX_THREADS);
+#endif
+#ifdef LOCK_PROFILE
+		lockprofile::getInstance().initialize();
+#endif
+#ifdef ENABLE_TRACE
+		char pidBuf[16];
+		sprintf(pidBuf, "_%d", getpid());
+		string traceFilename = string(__progname_full) + pidBuf + TRACE_FILE;
+		tracer::getInstance().initialize(traceFilename.c_str());
+#endif
+#ifdef MONITOR_EVENTFD
+		monitorEvent = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+#endif
+#ifdef ON_DEMAND_REPORT
+		reportRequested = false;
+#endif
 
 		// Initialze the Main thread
 		thread_t* current = getThreadInfoByIndex(0);
 		current->tIndex = 0;
 		current->startRoutine = 0;
+#ifdef DEADLOCK_RECOVERY
+		current->self = pthread_self();
+#endif
 
 		initializeRecord(current);
 		selfmap::getInstance().getTop(&current->stackTop, &textTop);
 		_threadIndex = 1;
 		_threadIndexReal = 0;
+		threadregistry::getInstance().initialize();
+		threadregistry::getInstance().add(0);
 		_monitor = 0;
+		_monitorStop = false;
+#if defined(FORK_ANALYSIS) && !defined(RUNTIME_OVERHEAD) && defined(ENABLE_ANALYZER) && !defined(DUMP_DEPENDENCIES)
+		pthread_atfork(prepareFork, afterFork, afterFork);
+#endif
 
 		installSignalHandler();
 
@@ -78,22 +134,138 @@ public:
 
 	// The end of system. 
 	void finalize(void) {
+#ifdef LIVE_STATS
+		livestats::getInstance().finalize();
+#endif
+#ifdef LOCK_PROFILE
+		lockprofile::getInstance().report();
+#endif
+#ifdef ENABLE_TRACE
+		tracer::getInstance().finalize();
+#endif
+#ifdef ENABLE_PREVENTION
+		if(enablePrevention) prevention::getInstance().reportStats(threadsInfo, _threadIndex);
+#endif
 #ifndef RUNTIME_OVERHEAD
 #ifdef ENABLE_ANALYZER
 #ifdef MONITOR_THREAD
-		if(_monitor > 0) pthread_kill(_monitor, 0);
+		stopMonitor();
 #endif
-		fprintf(stderr, "start analyzing..\n");
-		for(int i = 0; i < _threadIndex; i++) {
-			if(threadsInfo[i].tIndex >= 0) {
-				threadsInfoReal[_threadIndexReal].dependencies = threadsInfo[i].dependencies;
-				threadsInfoReal[_threadIndexReal++].depCount = threadsInfo[i].depCount;
-			}
+		int* live = new int[xdefines::MAX_THREADS];
+		int liveCount = threadregistry::getInstance().snapshot(live);
+		for(int k = 0; k < liveCount; k++) {
+			threadsInfoReal[_threadIndexReal].dependencies = threadsInfo[live[k]].dependencies;
+			threadsInfoReal[_threadIndexReal++].depCount = threadsInfo[live[k]].depCount;
 		}
+		delete[] live;
+#ifdef DUMP_DEPENDENCIES
+		// analyzed later by tools/undead-analyze
+		struct timespec historyMtime = timespec();
+#ifdef ENABLE_PREVENTION
+		historyMtime = prevention::getInstance().getLoadedMtime();
+#endif
+		char pidBuf[16];
+		sprintf(pidBuf, "_%d", getpid());
+		string dumpFilename = string(__progname_full) + pidBuf + DEP_DUMP_FILE;
+		depdump::getInstance().write(dumpFilename.c_str(), threadsInfoReal, _threadIndexReal, historyMtime);
+#else
+#ifdef FORK_ANALYSIS
+		if(forkAnalysis()) return;
+#endif
+		fprintf(stderr, "start analyzing..\n");
 		analyzer::getInstance().finalize(_threadIndexReal);
+#ifdef FORK_ANALYSIS
+		finishAnalysis();
+#endif
+#endif
+#endif
+#endif
+	}
+
+#if defined(FORK_ANALYSIS) && !defined(RUNTIME_OVERHEAD) && defined(ENABLE_ANALYZER) && !defined(DUMP_DEPENDENCIES)
+	// the child analyzes its copy of the records, the parent exits without waiting and returns true.
+	// The UnDead threads are stopped by now, and the locks of the other threads are held across
+	// the fork by prepareFork(). The child leaves the terminal and the pipes of the process,
+	// so nobody waits for it. Its output goes into <program>_<pid>.analysis, renamed into place
+	// when it is done. The analysis runs in a grandchild, watched by the child for its timeout.
+	bool forkAnalysis() {
+		char pidBuf[16];
+		sprintf(pidBuf, "_%d", getpid());
+		_analysisFilename = string(__progname_full) + pidBuf + ANALYSIS_FILE;
+		string tmpFilename = _analysisFilename + ".tmp";
+		fflush(stdout);
+		fflush(stderr);
+		pid_t child = fork();
+		if(child < 0) {
+			fprintf(stderr, "Failed to fork the analysis, analyzing in the process\n");
+			_analysisFilename.clear();
+			return false;
+		}
+		if(child > 0) {
+			fprintf(stderr, "Analysis continues in process %d, into %s\n", child, _analysisFilename.c_str());
+			return true;
+		}
+		setsid();
+		// the stderr of the program reports a killed analysis, unless whoever reads it would wait for it
+		int report = -1;
+		struct stat st;
+		if(fstat(STDERR_FILENO, &st) == 0 && !S_ISFIFO(st.st_mode) && !S_ISSOCK(st.st_mode)) report = dup(STDERR_FILENO);
+		int null = open("/dev/null", O_RDWR);
+		int out = open(tmpFilename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if(null >= 0) {
+			dup2(null, STDIN_FILENO);
+			dup2(null, STDOUT_FILENO);
+			dup2(out >= 0 ? out : null, STDERR_FILENO);
+			close(null);
+		}
+		if(out >= 0) close(out);
+		pid_t analysis = fork();
+		if(analysis > 0) watchAnalysis(analysis, report);
+		// analyzing here without a watcher if it failed
+		if(report >= 0) close(report);
+		// killed by SIGALRM, nothing half written is in place
+		alarm(xdefines::ANALYSIS_TIMEOUT_S);
+		return false;
+	}
+
+	// in the child, wait for the analysis and report it if it was killed
+	void watchAnalysis(pid_t analysis, int report) {
+		int status = 0;
+		while(waitpid(analysis, &status, 0) < 0 && errno == EINTR) { }
+		if(WIFSIGNALED(status)) {
+			char message[PATH_MAX + 128];
+			int len = snprintf(message, sizeof(message), "Analysis in process %d was killed by %s, its output is left in %s.tmp\n",
+				analysis, strsignal(WTERMSIG(status)), _analysisFilename.c_str());
+			if(len > (int)sizeof(message) - 1) len = sizeof(message) - 1;
+			if(report >= 0 && write(report, message, len) < 0) { }
+			if(write(STDERR_FILENO, message, len) < 0) { }
+		}
+		_exit(0);
+	}
+
+	static void prepareFork() {
+		xthread::getInstance().global_lock();
+#ifdef ONLINE_DETECTION
+		lockgraph::getInstance().lock();
 #endif
+	}
+
+	static void afterFork() {
+#ifdef ONLINE_DETECTION
+		lockgraph::getInstance().unlock();
 #endif
+		xthread::getInstance().global_unlock();
+	}
+
+	// in the child only, the rest of the exit belongs to the parent
+	void finishAnalysis() {
+		if(_analysisFilename.empty()) return;
+		fflush(stderr);
+		string tmpFilename = _analysisFilename + ".tmp";
+		rename(tmpFilename.c_str(), _analysisFilename.c_str());
+		_exit(0);
 	}
+#endif
 
 	void installSignalHandler() {
 		struct sigaction siga;
@@ -148,6 +320,16 @@ public:
 			fprintf(stderr, "Recieved SIGUSR1, Generating Report:\n");
 			exit(0);
 		} else if (signum == SIGUSR2) {
+#ifdef ON_DEMAND_REPORT
+			// the monitor thread is only created with the 1st thread, or already stopped at exit
+			if(__atomic_load_n(&xthread::getInstance()._monitor, __ATOMIC_ACQUIRE) != 0) {
+				// only async-signal-safe work, the monitor thread does the rest
+				__atomic_store_n(&reportRequested, true, __ATOMIC_RELEASE);
+				uint64_t one = 1;
+				if(write(monitorEvent, &one, sizeof(one)) < 0) { }
+				return;
+			}
+#endif
 			fprintf(stderr, "Recieved SIGUSR2, Generating Report:\n");
 			exit(0);
 		}
@@ -155,13 +337,28 @@ public:
 
 	// initialize the thread related data
 	INLINE static void initializeRecord(thread_t* thread) {
-		thread->dependencies = new Dependency[xdefines::MAX_DEPENDENCY];
+		beginHoldingUpdate(thread);
 		thread->curDep = NULL;
+		thread->holdingCount = 0;
+		endHoldingUpdate(thread);
 		thread->depCount = 0;
+		// a reused record is published after its count is cleared, for the monitor thread
+		__atomic_store_n(&thread->dependencies, new Dependency[xdefines::MAX_DEPENDENCY], __ATOMIC_RELEASE);
 		thread->isRecursive = false;
+#ifdef LIVE_STATS
+		thread->stats = livestats::getInstance().getStats(thread->tIndex, gettid());
+#endif
+#ifdef ENABLE_TRACE
+		thread->trace = tracer::getInstance().getRing(thread->tIndex, gettid());
+#endif
+#ifdef WAIT_FOR_GRAPH
+		// the epoch keeps counting in a reused record
+		__atomic_store_n(&thread->blockedOn, NULL, __ATOMIC_RELEASE);
+#endif
 		if(thread->holdingSet == NULL) {
 			// initialize for the 1st time
 			thread->holdingSet = new void*[xdefines::MAX_HOLDING_DEPTH];		
+			thread->holdingCallsite = new void*[xdefines::MAX_HOLDING_DEPTH];
 			thread->dependencyMap = new DependencyAddrHashMap;
 			thread->dependencyMap->initialize(HashFuncs::hashAddr, HashFuncs::compareAddr, xdefines::MAX_DEPENDENCY);
 			thread->offsetMap = new OffsetHashMap;
@@ -169,22 +366,37 @@ public:
 			thread->initOffsetMap = new OffsetHashMap;
 			thread->initOffsetMap->initialize(HashFuncs::hashAddr, HashFuncs::compareAddr, xdefines::MAX_DEPENDENCY);
 		} else {
-			// clear old for re-use
-			for(DependencyAddrHashMap::iterator iter = thread->dependencyMap->begin(); iter != thread->dependencyMap->end(); iter++) {
-				thread->dependencyMap->erase(iter.getkey(), 8);
+			// clear old for re-use, an entry is freed by erase() so step over it first
+			for(DependencyAddrHashMap::iterator iter = thread->dependencyMap->begin(); iter != thread->dependencyMap->end();) {
+				void* key = iter.getkey();
+				iter++;
+				thread->dependencyMap->erase(key, 8);
 			}
-			for(OffsetHashMap::iterator iter = thread->offsetMap->begin(); iter != thread->offsetMap->end(); iter++) {
-				thread->offsetMap->erase(iter.getkey(), 8);
+			for(OffsetHashMap::iterator iter = thread->offsetMap->begin(); iter != thread->offsetMap->end();) {
+				void* key = iter.getkey();
+				iter++;
+				thread->offsetMap->erase(key, 8);
 			}
-			for(OffsetHashMap::iterator iter = thread->initOffsetMap->begin(); iter != thread->offsetMap->end(); iter++) {
-				thread->initOffsetMap->erase(iter.getkey(), 8);
+			for(OffsetHashMap::iterator iter = thread->initOffsetMap->begin(); iter != thread->initOffsetMap->end();) {
+				void* key = iter.getkey();
+				iter++;
+				thread->initOffsetMap->erase(key, 8);
 			}
 		}
-		thread->holdingCount = 0;
 
 #ifdef ENABLE_PREVENTION
 		if(thread->specialHolding == NULL) {
-			thread->specialHolding = new special_holding[prevention::getInstance().getMergeSetAmount()];
+			thread->specialHolding = new int[prevention::getInstance().getSlotCapacity()]();
+			thread->specialCount = new int[prevention::getInstance().getSetCapacity()]();
+#ifdef ORDERED_PREVENTION
+			thread->orderPins = new int[prevention::getInstance().getSlotCapacity()]();
+			thread->orderTaken = new uint64_t[prevention::getInstance().getSlotCapacity()]();
+			thread->orderHeld = new uint64_t[prevention::getInstance().getSetCapacity()]();
+			thread->orderPinCount = thread->orderViolationCount = thread->orderUnboundCount = 0;
+#endif
+#ifdef ENABLE_AVOIDANCE
+			thread->avoidParkCount = thread->avoidParkNanos = thread->avoidTimeoutCount = 0;
+#endif
 		}
 #endif
 	}
@@ -212,6 +424,7 @@ public:
 		} else {
 			tindex = _threadIndex++;
 		}
+		threadregistry::getInstance().add(tindex);
 #if (!defined RUNTIME_OVERHEAD && defined ENABLE_ANALYZER && defined MONITOR_THREAD)
 		if(_monitor == 0) {
 			WRAP(pthread_create)(&_monitor, NULL, monitorThread, threadsInfo);
@@ -242,6 +455,7 @@ public:
 		} else {
 			aliveThreads--;
 			children->tIndex = -1;
+			threadregistry::getInstance().remove(tindex);
 		}
 		global_unlock();
 		return ret;
@@ -251,18 +465,29 @@ public:
 		thread_t* current = (thread_t*)arg;
 		isSingleThread = false;	
 		initializeRecord(current);		
+#ifdef DEADLOCK_RECOVERY
+		current->self = pthread_self();
+#endif
 		void* result = current->startRoutine(current->startArg);
 		return result;
 	}
 
 #ifdef ENABLE_ANALYZER
-	INLINE static void checkNew(thread_t* threads, void** lastHolding, int threadIndex, bool* sthNew, int* candidate) {
-		for(int i = 0; i < threadIndex; i++) {
-			thread_t* thread = &threads[i];
-			int holds = thread->holdingCount - 1;
+	INLINE static void checkNew(thread_t* threads, holding_snapshot* snapshots, void** lastHolding, int* live, int liveCount, bool* sthNew, int* candidate) {
+		for(int k = 0; k < liveCount; k++) {
+			int i = live[k];
+			holding_snapshot* snapshot = &snapshots[i];
+			if(!takeSnapshot(&threads[i], snapshot)) {
+				// still changing, nothing to analyze on it
+				snapshot->holdingCount = 0;
+				snapshot->curDep = NULL;
+				*sthNew = true;
+				continue;
+			}
+			int holds = snapshot->holdingCount - 1;
 			// check holding status
-			if(holds >= 0 && lastHolding[i] != thread->holdingSet[holds]) {
-				lastHolding[i] = thread->holdingSet[holds];
+			if(holds >= 0 && lastHolding[i] != snapshot->holdingSet[holds]) {
+				lastHolding[i] = snapshot->holdingSet[holds];
 				*sthNew = true; 
 				if(holds > 0) (*candidate)++;
 			} else if (holds < 0 && lastHolding[i] != NULL) {
@@ -272,35 +497,86 @@ public:
 		}
 	}
 
+#ifdef MONITOR_EVENTFD
+	// sleep until a thread blocks too long or a report is asked for, or for timeout ms, -1 for no timeout
+	static void waitEvent(int timeout) {
+		struct pollfd pfd;
+		pfd.fd = monitorEvent;
+		pfd.events = POLLIN;
+		if(poll(&pfd, 1, timeout) > 0) {
+			uint64_t count;
+			if(read(monitorEvent, &count, sizeof(count)) < 0) { }
+		}
+	}
+#endif
+
 	static void* monitorThread(void* arg) {
+#ifndef WAIT_FOR_GRAPH
 		thread_t* threads = (thread_t*)arg;
 		// current status 
 		void* lastHolding[xdefines::MAX_THREADS] = {NULL};
+#endif
 		int notRunning = 0;
 		bool hasCycle = false;
 		ChainStack* stack = new ChainStack;
+		holding_snapshot* snapshots = new holding_snapshot[xdefines::MAX_THREADS];
+		int* live = new int[xdefines::MAX_THREADS];
+#ifdef MONITOR_EVENTFD
+#if defined(EVENT_MONITOR) && !defined(HOT_RELOAD) && !defined(PERIODIC_DETECTION)
+		int idle = -1;
+#else
+		int idle = xdefines::MONITOR_PERIOD * 1000; // still works periodically
+#endif
+		int timeout = idle;
+		uint64_t lastPeriod = getNanos();
+#endif
 		while(1) {
+#ifdef MONITOR_EVENTFD
+			waitEvent(timeout);
+			if(__atomic_load_n(&xthread::getInstance()._monitorStop, __ATOMIC_ACQUIRE)) break;
+			// woken early, the periodic work keeps its period
+			bool periodic = getNanos() - lastPeriod >= xdefines::MONITOR_PERIOD * 1000000000UL;
+			if(periodic) lastPeriod = getNanos();
+#else
 			// sleep
 			sleep(xdefines::MONITOR_PERIOD);
+			bool periodic = true;
+#endif
+#ifdef ON_DEMAND_REPORT
+			if(__atomic_exchange_n(&reportRequested, false, __ATOMIC_ACQ_REL)) xthread::getInstance().reportOnDemand();
+#endif
+#ifndef EVENT_MONITOR
+			// so is the check of current status
+			if(!periodic) continue;
+#endif
+#if defined(ENABLE_PREVENTION) && defined(HOT_RELOAD)
+			if(periodic) prevention::getInstance().checkReload();
+#endif
 			if(aliveThreads < 2) continue; // if single thread, do nothing
+#ifdef PERIODIC_DETECTION
 			int threadIndex = xthread::getInstance().getThreadIndex();
+			// records of joined threads still count
+			if(periodic) analyzer::getInstance().detectPeriodic(threadIndex, xthread::getInstance().getJoinedIndex());
+#endif
+#if !defined(WAIT_FOR_GRAPH) || !defined(LOCK_CLASS)
+			int liveCount = threadregistry::getInstance().snapshot(live);
+#endif
+#ifdef WAIT_FOR_GRAPH
+#ifndef LOCK_CLASS
+			// threads publish the locks they block on, no need to guess from holdings
+#ifdef EVENT_MONITOR
+			bool blocked = analyzer::getInstance().analysisBlocked(live, liveCount, snapshots);
+			// check again soon to confirm, as long as some thread blocks
+			timeout = blocked ? (int)xdefines::BLOCK_THRESHOLD_MS : idle;
+#else
+			analyzer::getInstance().analysisBlocked(live, liveCount, snapshots);
+#endif
+#endif
+#else
 			int candidate = 0; // how many threads are holding locks
 			// check whether there's something new in all threads status
 			bool sthNew = false;
-			checkNew(threads, lastHolding, threadIndex, &sthNew, &candidate);
-			for(int i = 0; i < threadIndex; i++) {
-				thread_t* thread = &threads[i];
-				int holds = thread->holdingCount - 1;
-				// check holding status
-				if(holds >= 0 && lastHolding[i] != thread->holdingSet[holds]) {
-					lastHolding[i] = thread->holdingSet[holds];
-					sthNew = true; 
-					if(holds > 0) candidate++;
-				} else if (holds < 0 && lastHolding[i] != NULL) {
-					lastHolding[i] = NULL;
-					sthNew = true;
-				}
-			}
+			checkNew(threads, snapshots, lastHolding, live, liveCount, &sthNew, &candidate);
 #if 0
 			if(!sthNew) {	// nothing new
 				if(hasCycle && notRunning++ > xdefines::MONITOR_THRESHOLD) {
@@ -312,14 +588,34 @@ public:
 			notRunning = 0;
 #else
 			if(!sthNew) continue;
+#ifndef LOCK_CLASS
+			// holdings of lock classes can't confirm a hang
 			if(candidate > 1) { // check cycles if at least 2 threads
 				// check current status and terminate if confirm a deadlock
-				analyzer::getInstance().analysisCurrent(threadIndex, stack, lastHolding);
+				analyzer::getInstance().analysisCurrent(live, liveCount, stack, snapshots);
 			}
+#endif
+#endif
 #endif
 		}
 		delete stack;
+		delete[] snapshots;
+		delete[] live;
+		return NULL;
 	}
+
+#ifdef MONITOR_EVENTFD
+	// wake the monitor thread and wait for it, nothing it does may run alongside the analysis at exit
+	void stopMonitor() {
+		// exiting on the monitor thread itself, it does nothing else anymore
+		if(_monitor == 0 || pthread_equal(_monitor, pthread_self())) return;
+		__atomic_store_n(&_monitorStop, true, __ATOMIC_RELEASE);
+		uint64_t one = 1;
+		if(write(monitorEvent, &one, sizeof(one)) < 0) { }
+		WRAP(pthread_join)(_monitor, NULL);
+		_monitor = 0;
+	}
+#endif
 #endif
 
 	int thread_join(pthread_t tid, void** retval) {
@@ -333,9 +629,18 @@ public:
 			} else {
 				thread_t* joineeThread = &threadsInfo[joinee];
 				joineeThread->tIndex = -1; // for re-use
+#ifdef LIVE_STATS
+				joineeThread->stats->active = 0;
+#endif
+				threadregistry::getInstance().remove(joinee);
+				// pthread_t values are reused too
+				_xmap.erase((void*)tid, sizeof(void*));
 				// save info
-				threadsInfoReal[_threadIndexReal].dependencies =  joineeThread->dependencies;
-				threadsInfoReal[_threadIndexReal++].depCount =  joineeThread->depCount;
+				int joined = _threadIndexReal;
+				threadsInfoReal[joined].dependencies =  joineeThread->dependencies;
+				threadsInfoReal[joined].depCount =  joineeThread->depCount;
+				// published after the record, for periodic detection
+				__atomic_store_n(&_threadIndexReal, joined + 1, __ATOMIC_RELEASE);
 			}
 			if(--aliveThreads <= 1) isSingleThread = true;
 			global_unlock();
@@ -345,10 +650,40 @@ public:
 
 	INLINE int getThreadIndex() { return _threadIndex; }
 
+	// records of joined threads in threadsInfoReal
+	INLINE int getJoinedIndex() { return __atomic_load_n(&_threadIndexReal, __ATOMIC_ACQUIRE); }
+
+#ifdef ON_DEMAND_REPORT
+	// records of joined threads, then the ones of live threads as they are now
+	void reportOnDemand() {
+		int* live = new int[xdefines::MAX_THREADS];
+		global_lock();
+		vector<real_thread_t> records(threadsInfoReal, threadsInfoReal + _threadIndexReal);
+		int liveCount = threadregistry::getInstance().snapshot(live);
+		for(int k = 0; k < liveCount; k++) {
+			thread_t* thread = &threadsInfo[live[k]];
+			real_thread_t record;
+			// a record reused meanwhile is published with its count cleared
+			do {
+				record.dependencies = __atomic_load_n(&thread->dependencies, __ATOMIC_ACQUIRE);
+				record.depCount = __atomic_load_n(&thread->depCount, __ATOMIC_ACQUIRE);
+			} while(record.dependencies != __atomic_load_n(&thread->dependencies, __ATOMIC_ACQUIRE));
+			records.push_back(record);
+		}
+		global_unlock();
+		delete[] live;
+		analyzer::getInstance().reportOnDemand(&records[0], records.size());
+	}
+#endif
+
 private:
 	pthread_t _monitor;
+	bool _monitorStop; // set at exit, the monitor thread returns once woken
 	volatile int _threadIndex; // each thread has an index
 	volatile int _threadIndexReal; // for detection
+#ifdef FORK_ANALYSIS
+	string _analysisFilename; // output of the forked analysis
+#endif
 	typedef HashMap<void*, int, HeapAllocator> threadHashMap;
 	threadHashMap _xmap; // The hash map that map the address of pthread_t to thread index.
 	pthread_mutex_t _gMutex; // mutex lock to protect thread index